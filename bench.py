@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+"""Throughput benchmark: sends files from client to server through ./proxy under a matrix of
+impairment profiles and reports goodput, completion time, retransmissions and CPU time.
+
+Results are printed as a table and written as JSON (--json). Pass a previous run's JSON with
+--baseline to flag runs whose completion time got worse by more than --threshold.
+"""
+import argparse
+import json
+import os
+import random
+import re
+import resource
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+# name -> proxy arguments
+PROFILES = {
+    "clean": [],
+    "delay": ["--delay", "10"],
+    "loss1": ["--delay", "5", "--loss", "0.01"],
+    "loss5-jitter": ["--delay", "5", "--jitter", "5", "--loss", "0.05"],
+    "reorder": ["--delay", "5", "--reorder", "0.05", "--reorder-delay", "5"],
+    "dup": ["--delay", "5", "--dup", "0.05"],
+    "corrupt": ["--delay", "5", "--corrupt", "0.01"],
+    "bw50": ["--delay", "10", "--rate", "50", "--queue", "128"],
+}
+
+SIZES = {"1M": 1 << 20, "10M": 10 << 20, "4G+": (4 << 30) + (3 << 20)}
+DEFAULT_SIZES = "1M,10M"  # 4G+ checks that file offsets past 4GB (and the seq num wrap) land right
+
+
+def free_port():
+    return random.randint(20000, 50000)
+
+
+def wait_for(path, pattern, deadline):
+    """Waits until pattern shows up in the file at path or the deadline passes."""
+    while time.time() < deadline:
+        try:
+            with open(path) as f:
+                if pattern in f.read():
+                    return True
+        except FileNotFoundError:
+            pass
+        time.sleep(0.005)
+    return False
+
+
+def make_input(path, size):
+    """Random data. Files over 1GB are sparse, with 1MB of random data every 256MB and at the end,
+    so they are quick to create but misplaced data still fails the cmp."""
+    rng = random.Random(size)
+    with open(path, "wb") as f:
+        if size <= 1 << 30:
+            f.write(rng.randbytes(size))
+            return
+        f.truncate(size)
+        for off in list(range(0, size, 256 << 20)) + [size - (1 << 20)]:
+            f.seek(off)
+            f.write(rng.randbytes(min(1 << 20, size - off)))
+
+
+def stop(proc):
+    """Stops proc with SIGTERM and returns its CPU time in seconds."""
+    if proc.poll() is None:
+        proc.send_signal(signal.SIGTERM)
+    try:
+        _, _, usage = os.wait4(proc.pid, 0)
+    except ChildProcessError:
+        return 0.0
+    proc.returncode = 0
+    return usage.ru_utime + usage.ru_stime
+
+
+def retransmits(stderr_path):
+    """Sums the timeout and duplicate ack retransmissions from a peer's final stats line."""
+    timeout = dup = 0
+    with open(stderr_path) as f:
+        for m in re.finditer(r"retransmits: (\d+) timeout, (\d+) duplicate ack", f.read()):
+            timeout += int(m.group(1))
+            dup += int(m.group(2))
+    return timeout, dup
+
+
+def run_one(work, size_name, size, profile, seed, args):
+    src = os.path.join(work, "in-" + size_name)
+    if not os.path.exists(src):
+        make_input(src, size)
+    out_dir = tempfile.mkdtemp(dir=work)
+    server_port = free_port()
+    proxy_port = server_port + 1
+    logs = {name: os.path.join(out_dir, name + ".err") for name in ("server", "client", "proxy")}
+    extra = args.extra.split() if args.extra else []
+    server = subprocess.Popen([os.path.join(HERE, "server"), str(server_port), "--out-dir", out_dir] + extra,
+                              stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL, stderr=open(logs["server"], "w"))
+    proxy = subprocess.Popen([os.path.join(HERE, "proxy"), str(proxy_port), str(server_port), "--seed", str(seed)] + PROFILES[profile],
+                             stdout=subprocess.DEVNULL, stderr=open(logs["proxy"], "w"))
+    time.sleep(0.1)
+    start = time.time()
+    client = subprocess.Popen([os.path.join(HERE, "client"), "localhost", str(proxy_port), "--file", src] + extra,
+                              stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL, stderr=open(logs["client"], "w"))
+    done = wait_for(logs["server"], "Received all", start + args.timeout)
+    elapsed = time.time() - start
+    client_cpu = stop(client)
+    server_cpu = stop(server)
+    stop(proxy)
+
+    ok = False
+    if done:
+        outputs = [os.path.join(out_dir, f) for f in os.listdir(out_dir) if not f.endswith(".err")]
+        ok = len(outputs) == 1 and subprocess.run(["cmp", "-s", src, outputs[0]]).returncode == 0
+    timeout_rtx, dup_rtx = retransmits(logs["client"])
+    result = {
+        "size": size_name,
+        "bytes": size,
+        "profile": profile,
+        "seed": seed,
+        "ok": ok,
+        "seconds": round(elapsed, 4) if ok else None,
+        "goodput_mbps": round(size * 8 / elapsed / 1e6, 2) if ok else None,
+        "timeout_retransmits": timeout_rtx,
+        "dup_ack_retransmits": dup_rtx,
+        "client_cpu_s": round(client_cpu, 4),
+        "server_cpu_s": round(server_cpu, 4),
+    }
+    shutil.rmtree(out_dir)
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--sizes", default=DEFAULT_SIZES, help="comma separated subset of " + ",".join(SIZES))
+    parser.add_argument("--profiles", default=",".join(PROFILES), help="comma separated subset of " + ",".join(PROFILES))
+    parser.add_argument("--seed", type=int, default=1, help="proxy seed")
+    parser.add_argument("--timeout", type=float, default=60, help="seconds before a run counts as failed")
+    parser.add_argument("--extra", default="", help="extra arguments for both client and server, e.g. '--window 200'")
+    parser.add_argument("--json", default="bench-results.json", help="where to write the results")
+    parser.add_argument("--baseline", help="earlier results to compare against")
+    parser.add_argument("--threshold", type=float, default=0.2, help="allowed slowdown against the baseline (0.2 = 20%%)")
+    args = parser.parse_args()
+
+    for binary in ("server", "client", "proxy"):
+        if not os.path.exists(os.path.join(HERE, binary)):
+            sys.exit("Missing ./%s, run make first." % binary)
+
+    work = tempfile.mkdtemp(prefix="bench-")
+    results = []
+    print("%-6s %-14s %8s %10s %8s %8s %9s %9s" % ("size", "profile", "seconds", "Mbit/s", "rtx-to", "rtx-dup", "cpu-cli", "cpu-srv"))
+    try:
+        for size_name in args.sizes.split(","):
+            for profile in args.profiles.split(","):
+                r = run_one(work, size_name, SIZES[size_name], profile, args.seed, args)
+                results.append(r)
+                if r["ok"]:
+                    print("%-6s %-14s %8.3f %10.1f %8d %8d %9.3f %9.3f" % (size_name, profile, r["seconds"], r["goodput_mbps"],
+                          r["timeout_retransmits"], r["dup_ack_retransmits"], r["client_cpu_s"], r["server_cpu_s"]))
+                else:
+                    print("%-6s %-14s   FAILED" % (size_name, profile))
+                sys.stdout.flush()
+    finally:
+        shutil.rmtree(work)
+
+    with open(args.json, "w") as f:
+        json.dump({"extra": args.extra, "results": results}, f, indent=2)
+    print("Wrote", args.json)
+
+    failed = [r for r in results if not r["ok"]]
+    regressions = []
+    if args.baseline:
+        with open(args.baseline) as f:
+            base = {(r["size"], r["profile"]): r for r in json.load(f)["results"]}
+        for r in results:
+            b = base.get((r["size"], r["profile"]))
+            if r["ok"] and b and b["ok"] and r["seconds"] > b["seconds"] * (1 + args.threshold):
+                regressions.append(r)
+                print("REGRESSION %s/%s: %.3fs vs %.3fs" % (r["size"], r["profile"], r["seconds"], b["seconds"]))
+    if failed or regressions:
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
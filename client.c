@@ -1,4 +1,8 @@
+#define _GNU_SOURCE // recvmmsg/sendmmsg
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <unistd.h>
@@ -6,93 +10,3906 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <endian.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
-#define MAX_WINDOW_SIZE 20
+#define DEFAULT_WINDOW_SIZE 4096 // Only an upper bound: cwnd and the peer's receive window normally decide
+#define MAX_WINDOW_SIZE 65536
+#define INITIAL_CWND 10 // RFC 6928 initial window, in packets
+#define MAX_SACK_BLOCKS ((MSS - RWND_LEN - CSUM_LEN) / 8) // As many (start, end) pairs as fit in an ack's payload, with the trailers
+#define IO_BATCH 64 // Datagrams per sendmmsg/recvmmsg call
+#define GSO_MAX_SEGMENTS 64
+#define GSO_MAX_BYTES 65000
+#define GRO_BUF_SIZE 65536
+#define CACHE_LINE 64
+#define POOL_SLAB 64 // Packet buffers allocated at a time when a pool runs dry
+#define SMALL_BUF_PAYLOAD 256 // Payload room in the small size class that short held packets are copied into
+#define SOCKET_BUF_SIZE (4 * 1024 * 1024)
+#define RING_ENTRIES 256 // io_uring submission queue: every posted receive plus a batch of sends, with room to spare
+#define RING_CHUNK 65536 // Bytes per registered stdin/stdout buffer
+#define RING_WRITE_CHUNKS 8 // Registered output buffers; the sink waits for a write to finish once all are full
+#define DEFAULT_IDLE_TIMEOUT 60 // Seconds
+#define MAX_WORKERS 256
+#define PACING_QUANTUM_US 1000 // Burst allowed by the pacer, as time at the pacing rate
+#define PACING_GAIN_SLOW_START 2.0 // Pace faster than cwnd/SRTT so pacing never holds back cwnd growth
+#define PACING_GAIN 1.25
+#define FEC_MAX_GROUP 16
+#define FEC_MAX_PARITY 4
+#define FEC_TABLE_LEN (4 + 2 * FEC_MAX_GROUP) // Parity header and length table; data payloads shrink by this with FEC on
+#define FEC_CACHE_SIZE (4 * FEC_MAX_GROUP) // Recent packets kept to rebuild lost ones from
+#define FEC_ADAPT_GROUPS 32 // Groups in a row without retransmissions before dropping a parity packet
+#define DEFAULT_ACK_FREQ 2 // Ack every second data packet
+#define COMP_BUF_SIZE 65536 // Stdin read ahead when compressing
+#define COMP_MAX_INPUT 16384 // Most input one compressed packet covers, so a receiver knows how much room to decompress into
+#define COMP_MAX_SKIP 64 // Most packets sent raw before trying to compress again
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define DEFAULT_DELACK_US 2000 // Longest an ack is held back; well under RTO_MIN_US so it never causes a timeout
+#define DEFAULT_RECV_BUFFER (16 * 1024 * 1024) // Bytes of received data we hold at most: out of order packets and queued output
+#define MIN_RECV_BUFFER (64 * 1024) // Also what a peer's window counts as until its first ack says otherwise
+#define MAX_RECV_BUFFER (1024 * 1024 * 1024)
+#define PERSIST_MIN_US 200000 // Shortest wait before probing a closed window; the peer's own update usually comes first
+
+// Bits in the unused header byte. On SYN packets they advertise what we support,
+// after the handshake they describe the packet they are set on.
+#define EXT_SACK 0b00000001 // Payload of a pure ack holds SACK blocks
+#define EXT_COMP 0b00000010 // Data is compressed with lz_compress
+#define EXT_FEC 0b00000100 // Parity packet for a group of data packets
+#define EXT_CSUM 0b00001000 // A CRC32C of the datagram follows it (not counted in length); in a SYN or SYN-ACK, checksums are offered
+#define EXT_STREAM 0b00010000 // Payload starts with a stream frame
+#define EXT_RWND 0b00100000 // Our receive window follows the payload, before any checksum (not counted in length); in a SYN or SYN-ACK, windows are offered
+#define EXT_PROBE 0b01000000 // Path MTU probe (padding only), or on a pure ack, the echo of one
+#define EXT_OPTS 0b10000000 // Handshake options follow the data in a SYN or SYN-ACK
+
+// Handshake option types
+#define OPT_FILE_SIZE 1 // Size of the --file we are about to send (8 bytes)
+#define OPT_MAX_PAYLOAD 2 // Largest payload we can receive (2 bytes); MSS if absent
+#define OPT_TOKEN 3 // Server: resumption token for the client's next SYN. Client: the token we were given.
+#define OPT_STREAMS 4 // Streams we send in stream frames, counting stream 0 (2 bytes); absent if we don't use them
+
+#define TOKEN_LEN 12 // Issue time (4 bytes) and MAC (8 bytes)
+#define TOKEN_LIFETIME_S (24 * 3600)
+#define EARLY_DATA_MAX (MSS - 64) // Data a SYN with a token may carry, leaving room for the options
+
 #define HEADER_LEN 12
-#define MSS 1012 // MSS = Maximum Segment Size (aka max length)
+#define CSUM_LEN 4 // Checksum trailer
+#define RWND_LEN 4 // Receive window trailer: bytes past the ack the sender has room for
+#define STREAM_FRAME_LEN 6 // Stream ID (2 bytes) and the data's offset in the stream (4 bytes)
+#define MAX_STREAMS 256 // --stream files, on top of stdin or the --file as stream 0
+#define MSS 1012 // MSS = Maximum Segment Size (aka max length). Every peer supports this; larger ones are negotiated and probed.
+#define MAX_MSS 8960 // Payload of a 9000 byte MTU datagram
+#define DATAGRAM_OVERHEAD (28 + HEADER_LEN) // IPv4 and UDP headers plus ours: MTU = payload + this
+#define DEFAULT_MAX_MTU 1500
+#define PMTU_MAX_PROBES 3 // Unanswered probes before a size counts as too big (RFC 8899 MAX_PROBES)
+#define PMTU_SEARCH_STEP 32 // Stop searching once the largest working and smallest failing sizes are this close
+#define PMTU_RAISE_US 600000000ULL // Search for a larger size again after 10 minutes (RFC 8899 PMTU_RAISE_TIMER)
+#define PMTU_BLACK_HOLE_TIMEOUTS 3 // Timeouts in a row before falling back to MSS
+#define RTO_INITIAL_US 1000000 // RFC 6298: 1 second until the first RTT sample
+#define RTO_MIN_US 20000
+#define RTO_GRANULARITY_US (DEFAULT_DELACK_US + 3000) // RFC 6298's G: the default ack delay plus scheduling slack
+#define RTO_MAX_US 60000000
+typedef struct {
+	uint32_t ack;
+	uint32_t seq;
+	uint16_t length;
+	uint8_t flags;
+	uint8_t unused;
+	uint8_t payload[MSS]; // Nominal: pool buffers have room for the negotiated segment size, or SMALL_BUF_PAYLOAD in the
+	                      // small size class; only length bytes are valid
+} packet;
+
+typedef struct {
+   uint32_t start; // First seq num in the block
+   uint32_t end; // One past the last seq num in the block
+} sack_block;
+
+// RFC 6298 retransmission timeout estimator (all times in microseconds)
+typedef struct {
+   uint64_t srtt; // Smoothed RTT, 0 until the first sample
+   uint64_t rttvar; // RTT variation
+   uint64_t rto; // Current timeout, including exponential backoff
+   uint64_t min_rtt; // Lowest sample, 0 until the first one
+} rto_estimator;
+
+volatile sig_atomic_t stop_requested = 0;
+
+void handle_stop(int sig) {
+   stop_requested = 1;
+}
+
+volatile sig_atomic_t stats_requested = 0;
+
+void handle_stats(int sig) {
+   stats_requested = 1;
+}
+
+// Monotonic clock in microseconds, immune to wall clock adjustments
+uint64_t now_us() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Logging levels, picked at runtime with -q / -v
+#define LOG_ERROR 0 // Only errors and the final stats
+#define LOG_INFO 1 // Plus connection setup and other one-off events (default)
+#define LOG_TRACE 2 // Plus every trace event, printed as it happens
+
+int verbosity = LOG_INFO;
+
+#define LOG(level, ...) do { if (verbosity >= (level)) fprintf(stderr, __VA_ARGS__); } while (0)
+
+// Per-packet events are recorded into an in-memory ring instead of being printed. Only the format string
+// and up to TRACE_MAX_ARGS integer arguments are stored, so recording costs a clock read and a few stores.
+// The ring only has one writer and is dumped by that same thread, so it needs no locking.
+// The dump happens on SIGUSR2, on errors, or live with -v. Build with -DNO_TRACE to compile all of it out.
+#define TRACE_RING_SIZE 4096 // Must be a power of two
+#define TRACE_MAX_ARGS 4
+
+typedef struct {
+   uint64_t time; // now_us() when recorded
+   const char *fmt; // printf format taking TRACE_MAX_ARGS unsigned ints
+   uint32_t args[TRACE_MAX_ARGS];
+} trace_event;
+
+__thread trace_event trace_ring[TRACE_RING_SIZE]; // One ring per thread
+__thread uint64_t trace_count = 0; // Events recorded so far; the newest is at (trace_count - 1) % TRACE_RING_SIZE
+
+volatile sig_atomic_t trace_dump_requested = 0;
+
+void handle_trace_dump(int sig) {
+   trace_dump_requested = 1;
+}
+
+void trace_print(const trace_event *e) {
+   fprintf(stderr, "[%" PRIu64 ".%06" PRIu64 "] ", e->time / 1000000, e->time % 1000000);
+   fprintf(stderr, e->fmt, e->args[0], e->args[1], e->args[2], e->args[3]);
+}
+
+void trace_record(const char *fmt, const uint32_t *args) {
+   trace_event *e = &trace_ring[trace_count++ & (TRACE_RING_SIZE - 1)];
+   e->time = now_us();
+   e->fmt = fmt;
+   memcpy(e->args, args, sizeof(e->args));
+   if (verbosity >= LOG_TRACE) trace_print(e);
+}
+
+// Prints the recorded events, oldest first
+void trace_dump() {
+   uint64_t first = trace_count > TRACE_RING_SIZE ? trace_count - TRACE_RING_SIZE : 0;
+   if (first == trace_count) return;
+   fprintf(stderr, "Last %" PRIu64 " trace events:\n", trace_count - first);
+   for (uint64_t i = first; i < trace_count; i++) trace_print(&trace_ring[i & (TRACE_RING_SIZE - 1)]);
+}
+
+#ifdef NO_TRACE
+#define TRACE(fmt, ...) do { } while (0)
+#else
+// Arguments must be integers; the format sees each as an unsigned int (%u)
+#define TRACE(fmt, ...) trace_record(fmt "\n", (uint32_t[TRACE_MAX_ARGS]){__VA_ARGS__})
+#endif
+
+void rto_init(rto_estimator *rto) {
+   rto->srtt = 0;
+   rto->rttvar = 0;
+   rto->rto = RTO_INITIAL_US;
+   rto->min_rtt = 0;
+}
+
+// Feeds one RTT measurement into the estimator; this also clears any backoff
+void rto_sample(rto_estimator *rto, uint64_t rtt) {
+   if (rto->min_rtt == 0 || rtt < rto->min_rtt) rto->min_rtt = rtt;
+   if (rto->srtt == 0) {
+      rto->srtt = rtt;
+      rto->rttvar = rtt / 2;
+   } else {
+      uint64_t err = rtt > rto->srtt ? rtt - rto->srtt : rto->srtt - rtt;
+      rto->rttvar = (3 * rto->rttvar + err) / 4; // beta = 1/4
+      rto->srtt = (7 * rto->srtt + rtt) / 8; // alpha = 1/8
+   }
+   // The variance term never drops below G, or on a steady path the timer fires just before a delayed ack
+   rto->rto = rto->srtt + (4 * rto->rttvar > RTO_GRANULARITY_US ? 4 * rto->rttvar : RTO_GRANULARITY_US);
+   if (rto->rto < RTO_MIN_US) rto->rto = RTO_MIN_US;
+   if (rto->rto > RTO_MAX_US) rto->rto = RTO_MAX_US;
+}
+
+// Doubles the timeout after it expires
+void rto_backoff(rto_estimator *rto) {
+   rto->rto *= 2;
+   if (rto->rto > RTO_MAX_US) rto->rto = RTO_MAX_US;
+}
+
+// Arms the retransmission timer to fire once after us microseconds (0 disarms it)
+void set_timer(int timerfd, uint64_t us) {
+   struct itimerspec its = {0};
+   its.it_value.tv_sec = us / 1000000;
+   its.it_value.tv_nsec = (us % 1000000) * 1000;
+   if (timerfd_settime(timerfd, 0, &its, NULL) < 0) {
+      fprintf(stderr, "Error setting retransmission timer.\n");
+   }
+}
+
+// Packet buffer pool: cache line aligned buffers of one size, handed out as reference counted handles. Datagrams
+// are received straight into pool buffers and from then on only handles move, into the receive window and FEC
+// cache, or from the send window into the send batch. A pool sized for the largest payload can have a second,
+// small pool as its short size class, so short packets that are kept a while don't each pin a full size (up to
+// jumbo) buffer. Grows a slab at a time and never shrinks. Each thread's
+// pool belongs to its io_layer and is only touched from that thread, so the counts need no atomics.
+typedef struct pool_buf {
+   struct pkt_pool *pool;
+   struct pool_buf *next_free;
+   int refs;
+} pool_buf; // Sits in the cache line before each buffer
+
+typedef struct pkt_pool {
+   int size; // Usable bytes per buffer
+   int stride; // From one buffer's header to the next, in whole cache lines
+   pool_buf *free_list;
+   packet *current; // The buffer io_next() last handed out, if the datagram has it to itself
+   struct pkt_pool *small; // Size class pool_hold() copies short packets into, NULL if there is none
+   uint8_t **slabs; // Every slab allocated, so pool_free() can release them
+   int num_slabs;
+   uint64_t copied_bytes; // Bytes pool_hold() had to copy
+} pkt_pool;
+
+void pool_init(pkt_pool *p, int size) {
+   p->size = size;
+   p->stride = CACHE_LINE + (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+   p->free_list = NULL;
+   p->current = NULL;
+   p->small = NULL;
+   p->slabs = NULL;
+   p->num_slabs = 0;
+   p->copied_bytes = 0;
+}
+
+// Frees every slab; all buffers must have been returned
+void pool_free(pkt_pool *p) {
+   for (int i = 0; i < p->num_slabs; i++) free(p->slabs[i]);
+   free(p->slabs);
+   p->slabs = NULL;
+   p->num_slabs = 0;
+   p->free_list = NULL;
+}
+
+pool_buf *pool_header(packet *pkt) {
+   return (pool_buf *)((uint8_t *)pkt - CACHE_LINE);
+}
+
+// Returns a buffer holding one reference
+packet *pool_get(pkt_pool *p) {
+   if (p->free_list == NULL) {
+      uint8_t *slab = aligned_alloc(CACHE_LINE, (size_t)POOL_SLAB * p->stride);
+      uint8_t **slabs = realloc(p->slabs, (p->num_slabs + 1) * sizeof(uint8_t *));
+      if (slab == NULL || slabs == NULL) {
+         fprintf(stderr, "Failed to allocate packet buffers.\n");
+         exit(1);
+      }
+      p->slabs = slabs;
+      p->slabs[p->num_slabs++] = slab;
+      for (int i = POOL_SLAB - 1; i >= 0; i--) {
+         pool_buf *b = (pool_buf *)(slab + (size_t)i * p->stride);
+         b->pool = p;
+         b->next_free = p->free_list;
+         p->free_list = b;
+      }
+   }
+   pool_buf *b = p->free_list;
+   p->free_list = b->next_free;
+   b->refs = 1;
+   return (packet *)((uint8_t *)b + CACHE_LINE);
+}
+
+packet *pool_ref(packet *pkt) {
+   pool_header(pkt)->refs++;
+   return pkt;
+}
+
+// Drops a reference; the last one returns the buffer to its pool. NULL is ignored.
+void pool_put(packet *pkt) {
+   if (pkt == NULL) return;
+   pool_buf *b = pool_header(pkt);
+   if (--b->refs > 0) return;
+   b->next_free = b->pool->free_list;
+   b->pool->free_list = b;
+}
+
+// For a buffer about to be overwritten: returns pkt if ours is the only reference, otherwise drops it and returns
+// a fresh buffer, so whoever else holds pkt keeps its contents. pkt may be NULL.
+packet *pool_unshare(pkt_pool *p, packet *pkt) {
+   if (pkt != NULL && pool_header(pkt)->refs == 1) return pkt;
+   pool_put(pkt);
+   return pool_get(p);
+}
+
+// Returns a reference to a received packet of len bytes: pkt itself when it is the pool buffer io_next() just
+// handed out (or one a caller marked as current), otherwise a copy. A packet that fits the small size class is
+// always copied into it; that costs at most a few hundred bytes and frees the big buffer for the next receive.
+packet *pool_hold(pkt_pool *p, packet *pkt, int len) {
+   pkt_pool *to = p->small != NULL && len <= p->small->size ? p->small : p;
+   if (to == p && pkt == p->current) return pool_ref(pkt);
+   packet *copy = pool_get(to);
+   memcpy(copy, pkt, len);
+   p->copied_bytes += len;
+   return copy;
+}
+
+// CRC32C (Castagnoli polynomial) for checksum trailers and whole-stream digests
+uint32_t crc32c_table[8][256]; // Slicing-by-8 tables for the scalar kernel
+const char *crc_kernel = "scalar";
+
+// Continues crc (0 to start) over len more bytes, so crc32c(crc32c(0, a), b) is the CRC of a followed by b
+uint32_t crc32c_scalar(uint32_t crc, const uint8_t *p, size_t len) {
+   crc = ~crc;
+   for (; len >= 8; p += 8, len -= 8) {
+      uint64_t v;
+      memcpy(&v, p, 8);
+      v = le64toh(v) ^ crc;
+      crc = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff] ^ crc32c_table[5][(v >> 16) & 0xff] ^
+            crc32c_table[4][(v >> 24) & 0xff] ^ crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff] ^
+            crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
+   }
+   for (; len > 0; p++, len--) crc = crc32c_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+   return ~crc;
+}
+
+#if defined(__x86_64__)
+// Same as crc32c_scalar with the SSE4.2 crc32 instruction, 8 bytes at a time
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+   uint64_t c = ~crc;
+   for (; len >= 8; p += 8, len -= 8) {
+      uint64_t v;
+      memcpy(&v, p, 8);
+      c = _mm_crc32_u64(c, v);
+   }
+   crc = c;
+   for (; len > 0; p++, len--) crc = _mm_crc32_u8(crc, *p);
+   return ~crc;
+}
+#endif
+
+#if defined(__aarch64__)
+// Same as crc32c_scalar with the ARMv8 CRC32 instructions
+__attribute__((target("+crc")))
+uint32_t crc32c_armv8(uint32_t crc, const uint8_t *p, size_t len) {
+   crc = ~crc;
+   for (; len >= 8; p += 8, len -= 8) {
+      uint64_t v;
+      memcpy(&v, p, 8);
+      crc = __crc32cd(crc, v);
+   }
+   for (; len > 0; p++, len--) crc = __crc32cb(crc, *p);
+   return ~crc;
+}
+#endif
+
+uint32_t (*crc32c)(uint32_t crc, const uint8_t *p, size_t len) = crc32c_scalar;
+
+// Builds the tables and picks the fastest kernel the CPU supports; call once before any threads start
+void crc32c_init(void) {
+   for (int i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+      crc32c_table[0][i] = c;
+   }
+   for (int i = 0; i < 256; i++) {
+      for (int t = 1; t < 8; t++) {
+         crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+      }
+   }
+#if defined(__x86_64__)
+   if (__builtin_cpu_supports("sse4.2")) {
+      crc32c = crc32c_sse42;
+      crc_kernel = "sse4.2";
+   }
+#elif defined(__aarch64__)
+   if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+      crc32c = crc32c_armv8;
+      crc_kernel = "armv8";
+   }
+#endif
+}
+
+// Checks and strips the checksum trailer of a datagram that has one. Returns false if it doesn't match.
+bool packet_verify(packet *pkt, int *pkt_len) {
+   if (!(pkt->unused & EXT_CSUM)) return true;
+   if (*pkt_len < HEADER_LEN + CSUM_LEN) return false;
+   *pkt_len -= CSUM_LEN;
+   uint32_t crc;
+   memcpy(&crc, (uint8_t *)pkt + *pkt_len, CSUM_LEN);
+   return ntohl(crc) == crc32c(0, (const uint8_t *)pkt, *pkt_len);
+}
+
+// Strips the receive window trailer of a datagram that has one into *wnd. Returns false if it has none.
+bool packet_window(packet *pkt, int *pkt_len, uint32_t *wnd) {
+   if (!(pkt->unused & EXT_RWND) || *pkt_len < HEADER_LEN + RWND_LEN) return false;
+   *pkt_len -= RWND_LEN;
+   memcpy(wnd, (uint8_t *)pkt + *pkt_len, RWND_LEN);
+   *wnd = ntohl(*wnd);
+   return true;
+}
+
+// One outgoing datagram waiting in the batch
+typedef struct {
+   packet pkt; // Header, followed by the payload when it isn't borrowed
+   uint8_t spare[RWND_LEN + CSUM_LEN]; // Room for the trailers after a full pkt
+   const uint8_t *payload; // Payload borrowed from a pool buffer or mapped file, or NULL if it is in pkt
+   packet *ref; // Pool buffer the payload is in, referenced until it is sent; NULL if there is none
+   int head; // Bytes of pkt sent before the borrowed payload
+   int tail; // Bytes of pkt sent after it: the trailers, stored right after the head
+   int len; // Total datagram length
+   struct sockaddr_in addr;
+} outgoing;
+
+// What a completion is for, in the top half of its user_data (the bottom half is the message index)
+enum { RING_RECV, RING_SEND, RING_READ, RING_WRITE };
+
+// io_uring set up with the raw syscalls (--io-uring). Each wakeup drains the socket with one linked chain of
+// non-blocking receives, which ends at the first one that finds nothing, and each loop iteration's sends and
+// output writes go to the kernel in one io_uring_enter(). stdin is read ahead and stdout written behind
+// through registered buffers, one write in flight at a time so output stays in order.
+typedef struct {
+   int fd;
+   unsigned *sq_tail;
+   unsigned sq_mask;
+   unsigned *sq_array;
+   unsigned tail; // Our copy of the SQ tail, published on submit
+   struct io_uring_sqe *sqes;
+   unsigned *cq_head;
+   unsigned *cq_tail;
+   unsigned cq_mask;
+   struct io_uring_cqe *cqes;
+   unsigned queued; // SQEs filled in but not submitted yet
+   int pending; // Receive or send completions still to come
+   int *results; // Result of each receive or send in the current batch
+   uint8_t *bufs; // RING_CHUNK bytes each: the stdin read ahead, then the output chunks
+   bool fixed; // bufs are registered, so reads and writes use the fixed buffer opcodes
+   int read_fd; // fd the read ahead holds data from
+   bool read_nowait; // read_fd is a pipe or terminal: fail with EAGAIN rather than wait for data
+   int read_len;
+   int read_off;
+   int read_res;
+   bool read_done;
+   int wr_fd[RING_WRITE_CHUNKS];
+   int wr_len[RING_WRITE_CHUNKS];
+   int wr_off[RING_WRITE_CHUNKS]; // Bytes already written
+   int wr_head; // Oldest chunk with data
+   int wr_count; // Chunks with data; the last one takes more until it is sealed
+   bool wr_open; // The last chunk isn't sealed yet
+   bool wr_busy; // The oldest chunk is being written
+} uring;
+
+// Batched datagram I/O: recvmmsg() drains the socket in one call per wakeup and sendmmsg() flushes
+// everything queued, using UDP GSO/GRO when the kernel has it. With batching off (--no-batch, or no
+// recvmmsg/sendmmsg support) it falls back to one recvfrom()/sendmsg() per datagram. With --io-uring
+// (and a kernel that has it) both go through an io_uring instead.
+typedef struct {
+   int sockfd;
+   bool batching;
+   bool use_ring;
+   uring ring;
+   bool gso; // Kernel splits one big send into equal sized datagrams
+   bool gro; // Kernel may hand us several equal sized datagrams in one buffer
+   outgoing *out;
+   int out_count;
+   struct mmsghdr *send_msgs;
+   struct iovec *send_iovs;
+   char (*send_ctrl)[CMSG_SPACE(sizeof(uint16_t))];
+   // Receive buffers filled by io_recv() and walked with io_next(). Every message lands in a pool buffer so a
+   // datagram can be kept by reference; with GRO, a coalesced one spills over into a bigger buffer behind it.
+   pkt_pool pool;
+   pkt_pool small_pool; // pool's short size class
+   packet **recv_bufs; // One pool buffer per message
+   uint8_t *gro_bufs; // GRO_BUF_SIZE per message, NULL without GRO
+   struct mmsghdr *recv_msgs;
+   struct iovec *recv_iovs; // Two per message: the pool buffer, then the GRO overflow
+   struct sockaddr_in *recv_addrs;
+   char (*recv_ctrl)[CMSG_SPACE(sizeof(int))];
+   int num_msgs;
+   int cur_msg;
+   int cur_off; // Offset of the next datagram within the current buffer
+   int cur_seg; // GRO segment size of the current buffer
+   uint8_t *cur_base; // Start of the current message, made contiguous if it spilled over
+   int cur_copied; // Bytes io_next() copied to hand out the current datagram
+   uint8_t *scratch; // Copy of a GRO segment that isn't 4 byte aligned
+   uint64_t datagrams_in;
+   uint64_t datagrams_out;
+} io_layer;
+
+// This thread's io_layer when it uses io_uring, so stdin reads and stdout writes go through its ring too
+__thread io_layer *thread_ring_io = NULL;
+
+// Sets up the rings and registers the stdin/stdout buffers; returns false if the kernel can't do it
+bool ring_init(uring *r) {
+   struct io_uring_params p;
+   memset(&p, 0, sizeof(p));
+   r->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+   if (r->fd < 0) return false;
+   // Needs 5.6+: reads and writes at the file position, and no dropped completions
+   if (!(p.features & IORING_FEAT_RW_CUR_POS) || !(p.features & IORING_FEAT_NODROP)) {
+      close(r->fd);
+      return false;
+   }
+   uint8_t *sq = mmap(NULL, p.sq_off.array + p.sq_entries * sizeof(unsigned), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+   uint8_t *cq = mmap(NULL, p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+   r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+   if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+      close(r->fd);
+      return false;
+   }
+   r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+   r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+   r->sq_array = (unsigned *)(sq + p.sq_off.array);
+   r->tail = *r->sq_tail;
+   r->cq_head = (unsigned *)(cq + p.cq_off.head);
+   r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+   r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+   r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+   r->queued = 0;
+   r->pending = 0;
+   r->results = malloc(IO_BATCH * sizeof(int));
+   r->bufs = aligned_alloc(4096, (size_t)(1 + RING_WRITE_CHUNKS) * RING_CHUNK);
+   if (r->results == NULL || r->bufs == NULL) {
+      fprintf(stderr, "Failed to allocate I/O buffers.\n");
+      exit(1);
+   }
+   struct iovec iovs[1 + RING_WRITE_CHUNKS];
+   for (int i = 0; i <= RING_WRITE_CHUNKS; i++) iovs[i] = (struct iovec){r->bufs + (size_t)i * RING_CHUNK, RING_CHUNK};
+   // Past RLIMIT_MEMLOCK on older kernels; plain reads and writes into the same buffers work anyway
+   r->fixed = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iovs, 1 + RING_WRITE_CHUNKS) == 0;
+   r->read_fd = -1;
+   r->read_len = 0;
+   r->read_off = 0;
+   r->wr_head = 0;
+   r->wr_count = 0;
+   r->wr_open = false;
+   r->wr_busy = false;
+   return true;
+}
+
+// Submits everything queued and waits until at least wait completions are ready; returns -1 on error
+int ring_enter(uring *r, unsigned wait) {
+   __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+   int n = syscall(__NR_io_uring_enter, r->fd, r->queued, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+   if (n < 0) return errno == EINTR || errno == EBUSY ? 0 : -1; // EBUSY: reap completions first
+   r->queued -= n;
+   return 0;
+}
+
+// Returns a zeroed SQE to fill in, submitted by the next ring_enter()
+struct io_uring_sqe *ring_sqe(uring *r, int type, int index) {
+   if (r->queued == RING_ENTRIES) ring_enter(r, 0);
+   unsigned slot = r->tail & r->sq_mask;
+   struct io_uring_sqe *sqe = &r->sqes[slot];
+   memset(sqe, 0, sizeof(*sqe));
+   sqe->user_data = (uint64_t)type << 32 | (uint32_t)index;
+   r->sq_array[slot] = slot;
+   r->tail++;
+   r->queued++;
+   return sqe;
+}
+
+// Starts writing the oldest output chunk if nothing is being written and it is sealed
+void ring_write_next(uring *r) {
+   if (r->wr_busy || r->wr_count == 0 || (r->wr_count == 1 && r->wr_open)) return;
+   int i = r->wr_head;
+   struct io_uring_sqe *sqe = ring_sqe(r, RING_WRITE, i);
+   sqe->opcode = r->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+   sqe->fd = r->wr_fd[i];
+   sqe->addr = (uintptr_t)(r->bufs + (size_t)(1 + i) * RING_CHUNK + r->wr_off[i]);
+   sqe->len = r->wr_len[i] - r->wr_off[i];
+   sqe->off = (uint64_t)-1; // At the file position, like write()
+   sqe->buf_index = 1 + i;
+   r->wr_busy = true;
+}
+
+// Handles a finished write of the oldest chunk: finishes a short one, or moves on to the next chunk
+void ring_wrote(uring *r, int res) {
+   int i = r->wr_head;
+   r->wr_busy = false;
+   if (res < 0 && res != -EAGAIN && res != -EINTR) {
+      fprintf(stderr, "Error writing output.\n");
+      r->wr_off[i] = r->wr_len[i];
+   } else if (res > 0) {
+      r->wr_off[i] += res;
+   }
+   if (r->wr_off[i] == r->wr_len[i]) {
+      r->wr_head = (r->wr_head + 1) % RING_WRITE_CHUNKS;
+      r->wr_count--;
+      if (r->wr_count == 0) r->wr_open = false;
+   }
+   ring_write_next(r);
+}
+
+// Handles every completion that is ready
+void ring_reap(io_layer *io) {
+   uring *r = &io->ring;
+   unsigned head = *r->cq_head;
+   while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+      int index = (uint32_t)cqe->user_data;
+      switch (cqe->user_data >> 32) {
+         case RING_RECV:
+            if (cqe->res >= 0) io->recv_msgs[index].msg_len = cqe->res;
+            r->results[index] = cqe->res;
+            r->pending--;
+            break;
+         case RING_SEND:
+            r->results[index] = cqe->res;
+            r->pending--;
+            break;
+         case RING_READ:
+            r->read_res = cqe->res;
+            r->read_done = true;
+            break;
+         case RING_WRITE:
+            ring_wrote(r, cqe->res);
+            break;
+      }
+      head++;
+   }
+   __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Appends data to the output chunks, waiting for writes to finish while they are all full
+void ring_write(io_layer *io, int fd, const uint8_t *data, int len) {
+   uring *r = &io->ring;
+   while (len > 0) {
+      int last = (r->wr_head + r->wr_count - 1) % RING_WRITE_CHUNKS;
+      if (!r->wr_open || r->wr_fd[last] != fd || r->wr_len[last] == RING_CHUNK) {
+         if (r->wr_count == RING_WRITE_CHUNKS) {
+            r->wr_open = false;
+            ring_write_next(r);
+            ring_enter(r, 1);
+            ring_reap(io);
+            continue;
+         }
+         // Seal the last chunk and start another
+         last = (r->wr_head + r->wr_count++) % RING_WRITE_CHUNKS;
+         r->wr_fd[last] = fd;
+         r->wr_len[last] = 0;
+         r->wr_off[last] = 0;
+         r->wr_open = true;
+         if (r->wr_count > 1) ring_write_next(r);
+      }
+      int n = RING_CHUNK - r->wr_len[last] < len ? RING_CHUNK - r->wr_len[last] : len;
+      memcpy(r->bufs + (size_t)(1 + last) * RING_CHUNK + r->wr_len[last], data, n);
+      r->wr_len[last] += n;
+      data += n;
+      len -= n;
+   }
+}
+
+// Output bytes ring_write() takes for fd without waiting for a write to finish
+int ring_write_room(uring *r, int fd) {
+   int room = (RING_WRITE_CHUNKS - r->wr_count) * RING_CHUNK;
+   int last = (r->wr_head + r->wr_count - 1) % RING_WRITE_CHUNKS;
+   if (r->wr_open && r->wr_fd[last] == fd) room += RING_CHUNK - r->wr_len[last];
+   return room;
+}
+
+// Seals the output so far, to go out with the next submit
+void ring_write_seal(uring *r) {
+   r->wr_open = false;
+   ring_write_next(r);
+}
+
+// Waits until all output has been written
+void ring_sync(io_layer *io) {
+   uring *r = &io->ring;
+   ring_write_seal(r);
+   while (r->wr_count > 0) {
+      if (ring_enter(r, 1) < 0) break;
+      ring_reap(io);
+   }
+}
+
+// Reads like read() on a non-blocking fd, from the read ahead, refilling it RING_CHUNK bytes at a time
+int ring_read(io_layer *io, int fd, uint8_t *buf, int len) {
+   uring *r = &io->ring;
+   if (fd != r->read_fd) {
+      struct stat st;
+      r->read_fd = fd;
+      r->read_nowait = fstat(fd, &st) < 0 || !S_ISREG(st.st_mode); // A regular file never waits on a writer
+      r->read_len = 0;
+      r->read_off = 0;
+   }
+   if (r->read_off == r->read_len) {
+      struct io_uring_sqe *sqe = ring_sqe(r, RING_READ, 0);
+      sqe->opcode = r->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+      sqe->fd = fd;
+      sqe->addr = (uintptr_t)r->bufs;
+      sqe->len = RING_CHUNK;
+      sqe->off = (uint64_t)-1;
+      sqe->rw_flags = r->read_nowait ? RWF_NOWAIT : 0;
+      r->read_done = false;
+      while (!r->read_done) {
+         if (ring_enter(r, 1) < 0) return -1;
+         ring_reap(io);
+      }
+      if (r->read_res == -EOPNOTSUPP || r->read_res == -EINVAL) {
+         // No RWF_NOWAIT for this kind of file on older kernels; do without the ring for it
+         LOG(LOG_INFO, "Can't read input through io_uring, using read().\n");
+         thread_ring_io = NULL;
+         return read(fd, buf, len);
+      }
+      if (r->read_res <= 0) {
+         errno = -r->read_res;
+         return r->read_res == 0 ? 0 : -1;
+      }
+      r->read_len = r->read_res;
+      r->read_off = 0;
+   }
+   int n = r->read_len - r->read_off < len ? r->read_len - r->read_off : len;
+   memcpy(buf, r->bufs + r->read_off, n);
+   r->read_off += n;
+   return n;
+}
+
+// Points receive message i's header at its buffers
+void io_prep_recv(io_layer *io, int i) {
+   io->recv_iovs[2 * i] = (struct iovec){io->recv_bufs[i], io->pool.size};
+   if (io->gro) io->recv_iovs[2 * i + 1] = (struct iovec){io->gro_bufs + (size_t)i * GRO_BUF_SIZE + io->pool.size, GRO_BUF_SIZE - io->pool.size};
+   struct msghdr *hdr = &io->recv_msgs[i].msg_hdr;
+   hdr->msg_name = &io->recv_addrs[i];
+   hdr->msg_namelen = sizeof(io->recv_addrs[i]);
+   hdr->msg_iov = &io->recv_iovs[2 * i];
+   hdr->msg_iovlen = io->gro ? 2 : 1;
+   hdr->msg_control = io->gro ? io->recv_ctrl[i] : NULL;
+   hdr->msg_controllen = io->gro ? sizeof(io->recv_ctrl[i]) : 0;
+   hdr->msg_flags = 0;
+}
+
+// What the main loop polls, besides the socket, to hear about finished writes; -1 (ignored by poll()) without io_uring
+int io_ring_fd(io_layer *io) {
+   return io->use_ring ? io->ring.fd : -1;
+}
+
+// max_payload is the largest payload we accept, which sizes the pool's buffers. use_ring asks for io_uring.
+void io_init(io_layer *io, int sockfd, bool batching, bool use_ring, int max_payload) {
+   io->sockfd = sockfd;
+   io->batching = batching;
+   io->gso = false;
+   io->gro = false;
+   // Room for a full window burst, so the kernel doesn't drop what we just batched (needs root past rmem_max)
+   int buf_size = SOCKET_BUF_SIZE;
+   if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &buf_size, sizeof(buf_size)) < 0) {
+      setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+   }
+   if (setsockopt(sockfd, SOL_SOCKET, SO_SNDBUFFORCE, &buf_size, sizeof(buf_size)) < 0) {
+      setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+   }
+   if (batching) {
+      int on = 1;
+      int seg = 0;
+      socklen_t seg_len = sizeof(seg);
+      io->gso = getsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &seg, &seg_len) == 0;
+      io->gro = setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+   }
+   // Set DF and ignore the kernel's path MTU guess: our own probes decide how big datagrams get (DPLPMTUD)
+   int pmtu_mode = IP_PMTUDISC_PROBE;
+   setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu_mode, sizeof(pmtu_mode));
+   pool_init(&io->pool, HEADER_LEN + max_payload);
+   pool_init(&io->small_pool, HEADER_LEN + SMALL_BUF_PAYLOAD);
+   io->pool.small = &io->small_pool;
+   io->out = malloc(IO_BATCH * sizeof(outgoing));
+   io->send_msgs = calloc(IO_BATCH, sizeof(struct mmsghdr));
+   io->send_iovs = malloc(3 * IO_BATCH * sizeof(struct iovec));
+   io->send_ctrl = malloc(IO_BATCH * sizeof(*io->send_ctrl));
+   io->recv_bufs = malloc(IO_BATCH * sizeof(packet *));
+   io->gro_bufs = io->gro ? malloc((size_t)IO_BATCH * GRO_BUF_SIZE) : NULL;
+   io->recv_msgs = calloc(IO_BATCH, sizeof(struct mmsghdr));
+   io->recv_iovs = malloc(2 * IO_BATCH * sizeof(struct iovec));
+   io->recv_addrs = malloc(IO_BATCH * sizeof(struct sockaddr_in));
+   io->recv_ctrl = malloc(IO_BATCH * sizeof(*io->recv_ctrl));
+   io->scratch = malloc(HEADER_LEN + MAX_MSS);
+   if (io->out == NULL || io->send_msgs == NULL || io->send_iovs == NULL || io->send_ctrl == NULL || io->recv_bufs == NULL ||
+       (io->gro && io->gro_bufs == NULL) || io->recv_msgs == NULL || io->recv_iovs == NULL || io->recv_addrs == NULL || io->recv_ctrl == NULL || io->scratch == NULL) {
+      fprintf(stderr, "Failed to allocate I/O buffers.\n");
+      exit(1);
+   }
+   for (int i = 0; i < IO_BATCH; i++) io->recv_bufs[i] = pool_get(&io->pool);
+   io->out_count = 0;
+   io->num_msgs = 0;
+   io->cur_msg = 0;
+   io->datagrams_in = 0;
+   io->datagrams_out = 0;
+   io->use_ring = use_ring && ring_init(&io->ring);
+   if (use_ring && !io->use_ring) LOG(LOG_INFO, "io_uring not available, using the default I/O path.\n");
+   if (io->use_ring) {
+      thread_ring_io = io;
+      LOG(LOG_INFO, "Datagram I/O: io_uring%s%s, %s stdin/stdout buffers\n", io->gso ? ", GSO" : "", io->gro ? ", GRO" : "",
+              io->ring.fixed ? "registered" : "unregistered");
+   } else {
+      LOG(LOG_INFO, "Datagram I/O: %s%s%s\n", batching ? "sendmmsg/recvmmsg" : "one syscall per datagram",
+              io->gso ? ", GSO" : "", io->gro ? ", GRO" : "");
+   }
+}
+
+// Writes out whatever output is still buffered, shuts the ring down and frees what io_init() allocated.
+// Every pool buffer must have been returned by then.
+void io_close(io_layer *io) {
+   if (io->use_ring) {
+      ring_sync(io);
+      if (thread_ring_io == io) thread_ring_io = NULL;
+      close(io->ring.fd);
+      free(io->ring.results);
+      free(io->ring.bufs);
+      io->use_ring = false;
+   }
+   for (int i = 0; i < io->out_count; i++) pool_put(io->out[i].ref);
+   for (int i = 0; i < IO_BATCH; i++) pool_put(io->recv_bufs[i]);
+   free(io->out);
+   free(io->send_msgs);
+   free(io->send_iovs);
+   free(io->send_ctrl);
+   free(io->recv_bufs);
+   free(io->gro_bufs);
+   free(io->recv_msgs);
+   free(io->recv_iovs);
+   free(io->recv_addrs);
+   free(io->recv_ctrl);
+   free(io->scratch);
+   pool_free(&io->pool);
+   pool_free(&io->small_pool);
+}
+
+// The io_uring version of recvmmsg(): a chain of receives, in order, each failing with EAGAIN rather than
+// waiting once the socket is empty, which cancels the rest
+int ring_recv(io_layer *io) {
+   uring *r = &io->ring;
+   for (int i = 0; i < IO_BATCH; i++) {
+      io_prep_recv(io, i);
+      struct io_uring_sqe *sqe = ring_sqe(r, RING_RECV, i);
+      sqe->opcode = IORING_OP_RECVMSG;
+      sqe->fd = io->sockfd;
+      sqe->addr = (uintptr_t)&io->recv_msgs[i].msg_hdr;
+      sqe->len = 1;
+      sqe->msg_flags = MSG_DONTWAIT;
+      if (i < IO_BATCH - 1) sqe->flags = IOSQE_IO_LINK;
+   }
+   r->pending = IO_BATCH;
+   while (r->pending > 0) {
+      if (ring_enter(r, r->pending) < 0) return 0;
+      ring_reap(io);
+   }
+   while (io->num_msgs < IO_BATCH && r->results[io->num_msgs] >= 0) io->num_msgs++;
+   return io->num_msgs;
+}
+
+// Reads every datagram waiting on the socket (up to IO_BATCH buffers); returns the number of buffers read
+int io_recv(io_layer *io) {
+   io->num_msgs = 0;
+   io->cur_msg = 0;
+   io->cur_off = 0;
+   io->pool.current = NULL;
+   // Buffers still referenced from the last batch (packets kept out of order) are swapped for fresh ones
+   for (int i = 0; i < (io->batching || io->use_ring ? IO_BATCH : 1); i++) io->recv_bufs[i] = pool_unshare(&io->pool, io->recv_bufs[i]);
+   if (io->use_ring) return ring_recv(io);
+   if (!io->batching) {
+      socklen_t addr_len = sizeof(io->recv_addrs[0]);
+      int n = recvfrom(io->sockfd, io->recv_bufs[0], io->pool.size, 0, (struct sockaddr*) &io->recv_addrs[0], &addr_len);
+      if (n < 0) return 0;
+      io->recv_msgs[0].msg_len = n;
+      io->recv_msgs[0].msg_hdr.msg_controllen = 0;
+      io->num_msgs = 1;
+      return 1;
+   }
+   for (int i = 0; i < IO_BATCH; i++) io_prep_recv(io, i);
+   int n = recvmmsg(io->sockfd, io->recv_msgs, IO_BATCH, MSG_DONTWAIT, NULL);
+   if (n < 0) {
+      if (errno == ENOSYS) {
+         LOG(LOG_INFO, "recvmmsg not supported, falling back to recvfrom.\n");
+         io->batching = false;
+         return io_recv(io);
+      }
+      return 0;
+   }
+   io->num_msgs = n;
+   return n;
+}
+
+// Returns the GRO segment size of received buffer i, or 0 if it holds a single datagram
+int io_segment_size(io_layer *io, int i) {
+   struct msghdr *hdr = &io->recv_msgs[i].msg_hdr;
+   if (hdr->msg_controllen == 0) return 0;
+   for (struct cmsghdr *cm = CMSG_FIRSTHDR(hdr); cm != NULL; cm = CMSG_NXTHDR(hdr, cm)) {
+      if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+         int seg;
+         memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+         return seg;
+      }
+   }
+   return 0;
+}
+
+// Hands out the next received datagram (splitting GRO buffers); returns its length, or -1 once all are used up.
+// A datagram that has its pool buffer to itself becomes the pool's current buffer, so it can be kept by reference.
+int io_next(io_layer *io, packet **pkt, struct sockaddr_in *addr) {
+   io->cur_copied = 0;
+   while (io->cur_msg < io->num_msgs) {
+      int total = io->recv_msgs[io->cur_msg].msg_len;
+      if (io->cur_off == 0) {
+         io->cur_seg = io_segment_size(io, io->cur_msg);
+         if (io->cur_seg <= 0) io->cur_seg = total;
+         io->cur_base = (uint8_t *)io->recv_bufs[io->cur_msg];
+         if (total > io->pool.size) {
+            // Spilled past the pool buffer: put its start back in front of the rest
+            uint8_t *gro = io->gro_bufs + (size_t)io->cur_msg * GRO_BUF_SIZE;
+            memcpy(gro, io->cur_base, io->pool.size);
+            io->cur_base = gro;
+            io->cur_copied += io->pool.size;
+         }
+      }
+      if (io->cur_off >= total) {
+         io->cur_msg++;
+         io->cur_off = 0;
+         continue;
+      }
+      uint8_t *buf = io->cur_base + io->cur_off;
+      int len = total - io->cur_off < io->cur_seg ? total - io->cur_off : io->cur_seg;
+      if (len > io->pool.size) len = io->pool.size;
+      io->cur_off += io->cur_seg;
+      *addr = io->recv_addrs[io->cur_msg];
+      io->pool.current = len == total && buf == (uint8_t *)io->recv_bufs[io->cur_msg] ? (packet *)buf : NULL;
+      if ((uintptr_t)buf % 4 != 0) {
+         memcpy(io->scratch, buf, len);
+         buf = io->scratch;
+         io->cur_copied += len;
+      }
+      *pkt = (packet *)buf;
+      io->datagrams_in++;
+      return len;
+   }
+   return -1;
+}
+
+// True if datagrams from the last io_recv() are still waiting for io_next()
+bool io_more(io_layer *io) {
+   if (io->cur_msg >= io->num_msgs) return false;
+   return io->cur_msg < io->num_msgs - 1 || io->cur_off < (int)io->recv_msgs[io->cur_msg].msg_len;
+}
+
+// Sends the flush's num_msgs messages through the ring and waits for them; returns false if GSO turned out
+// not to work, so everything has to be sent again without it
+bool ring_send(io_layer *io, int num_msgs) {
+   uring *r = &io->ring;
+   for (int i = 0; i < num_msgs; i++) {
+      struct io_uring_sqe *sqe = ring_sqe(r, RING_SEND, i);
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = io->sockfd;
+      sqe->addr = (uintptr_t)&io->send_msgs[i].msg_hdr;
+      sqe->len = 1;
+   }
+   r->pending = num_msgs;
+   while (r->pending > 0) {
+      if (ring_enter(r, r->pending) < 0) {
+         fprintf(stderr, "Error sending datagrams.\n");
+         return true;
+      }
+      ring_reap(io);
+   }
+   bool failed = false;
+   for (int i = 0; i < num_msgs; i++) {
+      int res = r->results[i];
+      if ((res == -EIO || res == -EINVAL) && io->gso && io->send_msgs[i].msg_hdr.msg_controllen > 0) {
+         LOG(LOG_INFO, "GSO send failed, falling back to one datagram per send.\n");
+         io->gso = false;
+         return false;
+      }
+      failed |= res < 0 && res != -EMSGSIZE; // A too big path MTU probe is just lost
+   }
+   if (failed) fprintf(stderr, "Error sending datagrams.\n");
+   return true;
+}
+
+// Sends every queued datagram, grouping runs of equal sized ones to the same peer into GSO sends
+void io_flush(io_layer *io) {
+   if (io->use_ring) {
+      // This round's output goes to the kernel with the sends
+      ring_write_seal(&io->ring);
+      if (io->out_count == 0 && io->ring.queued > 0) ring_enter(&io->ring, 0);
+   }
+   if (io->out_count == 0) return;
+   int num_msgs = 0;
+   int num_iovs = 0;
+   int first = 0;
+   while (first < io->out_count) {
+      // Extend the run while datagrams match the first one's size (only the last may be shorter)
+      int last = first;
+      int total = io->out[first].len;
+      while (io->gso && last + 1 < io->out_count && last + 1 - first < GSO_MAX_SEGMENTS &&
+             io->out[last].len == io->out[first].len && total + io->out[last + 1].len <= GSO_MAX_BYTES &&
+             io->out[last + 1].len <= io->out[first].len &&
+             memcmp(&io->out[last + 1].addr, &io->out[first].addr, sizeof(struct sockaddr_in)) == 0) {
+         last++;
+         total += io->out[last].len;
+      }
+      struct msghdr *hdr = &io->send_msgs[num_msgs].msg_hdr;
+      memset(hdr, 0, sizeof(*hdr));
+      hdr->msg_name = &io->out[first].addr;
+      hdr->msg_namelen = sizeof(struct sockaddr_in);
+      hdr->msg_iov = &io->send_iovs[num_iovs];
+      for (int i = first; i <= last; i++) {
+         outgoing *o = &io->out[i];
+         if (o->payload == NULL) {
+            io->send_iovs[num_iovs++] = (struct iovec){&o->pkt, o->len};
+         } else {
+            io->send_iovs[num_iovs++] = (struct iovec){&o->pkt, o->head};
+            io->send_iovs[num_iovs++] = (struct iovec){(void *)o->payload, o->len - o->head - o->tail};
+            if (o->tail > 0) io->send_iovs[num_iovs++] = (struct iovec){(uint8_t *)&o->pkt + o->head, o->tail};
+         }
+      }
+      hdr->msg_iovlen = &io->send_iovs[num_iovs] - hdr->msg_iov;
+      if (last > first) {
+         hdr->msg_control = io->send_ctrl[num_msgs];
+         hdr->msg_controllen = sizeof(io->send_ctrl[num_msgs]);
+         struct cmsghdr *cm = CMSG_FIRSTHDR(hdr);
+         cm->cmsg_level = SOL_UDP;
+         cm->cmsg_type = UDP_SEGMENT;
+         cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+         uint16_t seg = io->out[first].len;
+         memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+      }
+      num_msgs++;
+      first = last + 1;
+   }
+
+   if (io->use_ring && !ring_send(io, num_msgs)) {
+      io_flush(io);
+      return;
+   }
+   int sent = io->use_ring ? num_msgs : 0;
+   while (sent < num_msgs) {
+      int n;
+      if (io->batching) {
+         n = sendmmsg(io->sockfd, &io->send_msgs[sent], num_msgs - sent, 0);
+      } else {
+         n = sendmsg(io->sockfd, &io->send_msgs[sent].msg_hdr, 0) < 0 ? -1 : 1;
+      }
+      if (n < 0) {
+         if (errno == ENOSYS && io->batching) {
+            LOG(LOG_INFO, "sendmmsg not supported, falling back to sendmsg.\n");
+            io->batching = false;
+            continue;
+         }
+         if ((errno == EIO || errno == EINVAL) && io->gso) {
+            // No GSO for this route after all; requeue everything as single datagrams
+            LOG(LOG_INFO, "GSO send failed, falling back to one datagram per send.\n");
+            io->gso = false;
+            io_flush(io);
+            return;
+         }
+         if (errno == EMSGSIZE) {
+            // Bigger than the interface MTU, as a path MTU probe can be: it is lost, but send the rest
+            sent++;
+            continue;
+         }
+         // Socket buffer full or similar: drop the rest, retransmission will cover it
+         fprintf(stderr, "Error sending datagrams.\n");
+         break;
+      }
+      sent += n;
+   }
+   for (int i = 0; i < io->out_count; i++) pool_put(io->out[i].ref);
+   io->out_count = 0;
+}
+
+// Adds a datagram to the batch: the first head bytes of pkt, then len - head payload bytes taken from payload (left
+// in place until io_flush()) or, if payload is NULL, the whole datagram from pkt itself (at most MSS bytes of payload).
+// ref is a pool buffer to hold a reference on until then, or NULL. A datagram marked EXT_RWND gets receive window
+// wnd appended, and one marked EXT_CSUM its checksum trailer after that, so it covers exactly what is sent,
+// piggybacked ack included.
+void io_push(io_layer *io, packet *pkt, int head, int len, const uint8_t *payload, packet *ref, uint32_t wnd, struct sockaddr_in *addr) {
+   if (io->out_count == IO_BATCH) io_flush(io);
+   outgoing *o = &io->out[io->out_count++];
+   o->head = payload == NULL ? len : head;
+   memcpy(&o->pkt, pkt, o->head);
+   o->payload = payload;
+   o->ref = ref;
+   o->len = len;
+   uint8_t *tail = (uint8_t *)&o->pkt + o->head;
+   int tail_len = 0;
+   if (pkt->unused & EXT_RWND) {
+      wnd = htonl(wnd);
+      memcpy(tail, &wnd, RWND_LEN);
+      tail_len += RWND_LEN;
+   }
+   if (pkt->unused & EXT_CSUM) {
+      uint32_t crc = crc32c(0, (const uint8_t *)&o->pkt, o->head);
+      if (payload != NULL) crc = crc32c(crc, payload, len - o->head);
+      crc = htonl(crc32c(crc, tail, tail_len));
+      memcpy(tail + tail_len, &crc, CSUM_LEN);
+      tail_len += CSUM_LEN;
+   }
+   o->tail = payload != NULL ? tail_len : 0;
+   o->len += tail_len;
+   o->addr = *addr;
+   io->datagrams_out++;
+   if (!io->batching) io_flush(io);
+}
+
+// Queues a datagram whose payload (if not NULL) stays put until the program exits, like a mapped file.
+// A stream frame is sent from pkt along with the header.
+void io_queue(io_layer *io, packet *pkt, int len, const uint8_t *payload, struct sockaddr_in *addr) {
+   io_push(io, pkt, HEADER_LEN + (pkt->unused & EXT_STREAM ? STREAM_FRAME_LEN : 0), len, payload, NULL, 0, addr);
+}
+
+// Queues pool buffer pkt, copying only its header. The payload is sent from the buffer, which the owner may
+// go on to drop or replace (with pool_unshare()) right away.
+void io_queue_ref(io_layer *io, packet *pkt, int len, struct sockaddr_in *addr) {
+   io_push(io, pkt, HEADER_LEN, len, pkt->payload, pool_ref(pkt), 0, addr);
+}
+
+// Where our outgoing data comes from: stdin, or a --file mapped into memory so packets point straight at it
+typedef struct {
+   int fd;
+   bool file; // Sending a --file rather than stdin
+   const uint8_t *map; // NULL when reading stdin (or the file is empty)
+   uint64_t size;
+   uint64_t off; // Next byte to packetize (for stdin, bytes read so far)
+   uint32_t digest; // CRC32C of the stdin data read so far
+} input_source;
+
+// Where in-order data from the peer goes: stdout or an --out file. When the peer announces its file size
+// during the handshake the --out file is mapped instead, and every packet is copied straight to its offset.
+typedef struct {
+   int fd;
+   uint8_t *map; // NULL unless writing by offset
+   uint64_t size;
+   uint32_t base; // Seq num of the byte at file offset base_off; follows the peer's in-order data
+   uint64_t base_off; // 64 bits, so files of 4GB and more don't wrap along with seq nums
+   uint32_t digest; // CRC32C of the data written so far; when writing by offset, of the whole file once it is complete
+   uint8_t *queue; // Streamed data the output hasn't taken yet (stdout is non-blocking), from queue_off to queue_len
+   int queue_off;
+   int queue_len;
+   int queue_cap;
+   bool done;
+   bool owned; // fd is ours alone, so it can be resized, mapped and closed
+   bool failed; // The queue couldn't grow, so data was lost; the connection has to go
+} output_sink;
+
+// Opens path as the input source (NULL means stdin); returns -1 on error
+int source_open(input_source *src, const char *path) {
+   src->fd = STDIN_FILENO;
+   src->file = path != NULL;
+   src->map = NULL;
+   src->size = 0;
+   src->off = 0;
+   src->digest = 0;
+   if (path == NULL) return 0;
+   src->fd = open(path, O_RDONLY);
+   struct stat st;
+   if (src->fd < 0 || fstat(src->fd, &st) < 0) {
+      fprintf(stderr, "Failed to open %s.\n", path);
+      return -1;
+   }
+   src->size = st.st_size;
+   if (src->size > 0) {
+      void *map = mmap(NULL, src->size, PROT_READ, MAP_PRIVATE, src->fd, 0);
+      if (map == MAP_FAILED) {
+         fprintf(stderr, "Failed to map %s.\n", path);
+         return -1;
+      }
+      madvise(map, src->size, MADV_SEQUENTIAL);
+      src->map = map;
+   }
+   return 0;
+}
+
+// Returns a pointer to the next chunk of the mapped file and sets *len (0 once everything is packetized)
+const uint8_t *source_next(input_source *src, int max, int *len) {
+   uint64_t left = src->size - src->off;
+   *len = left < (uint64_t)max ? (int)left : max;
+   const uint8_t *chunk = src->map + src->off;
+   src->off += *len;
+   return chunk;
+}
+
+// Opens path as the output sink (NULL means stdout); returns -1 on error
+int sink_open(output_sink *out, const char *path) {
+   out->fd = STDOUT_FILENO;
+   out->map = NULL;
+   out->size = 0;
+   out->base = 0;
+   out->base_off = 0;
+   out->digest = 0;
+   out->queue = NULL;
+   out->queue_off = 0;
+   out->queue_len = 0;
+   out->queue_cap = 0;
+   out->done = false;
+   out->owned = false;
+   out->failed = false;
+   if (path == NULL) return 0;
+   out->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (out->fd < 0) {
+      fprintf(stderr, "Failed to open %s.\n", path);
+      return -1;
+   }
+   out->owned = true;
+   return 0;
+}
+
+// Streamed data still queued for the output
+int sink_queued(output_sink *out) {
+   return out->queue_len - out->queue_off;
+}
+
+// Writes out as much queued data as the output takes without waiting, in one write() for everything delivered
+// since the last call or, with io_uring, as much as fits in the free output chunks. Returns the bytes still queued.
+int sink_flush(output_sink *out) {
+   while (out->queue_off < out->queue_len) {
+      int n = sink_queued(out);
+      if (thread_ring_io != NULL) {
+         int room = ring_write_room(&thread_ring_io->ring, out->fd);
+         if (room == 0) break;
+         if (room < n) n = room;
+         ring_write(thread_ring_io, out->fd, out->queue + out->queue_off, n);
+      } else if ((n = write(out->fd, out->queue + out->queue_off, n)) < 0) {
+         if (errno == EINTR) continue;
+         if (errno != EAGAIN) {
+            fprintf(stderr, "Error writing output.\n");
+            out->queue_off = out->queue_len;
+         }
+         break;
+      }
+      out->queue_off += n;
+   }
+   if (out->queue_off == out->queue_len) out->queue_off = out->queue_len = 0;
+   return sink_queued(out);
+}
+
+// Writes out everything still queued, waiting for the output as long as it takes
+void sink_drain(output_sink *out) {
+   while (sink_flush(out) > 0) {
+      if (thread_ring_io != NULL) {
+         ring_write_seal(&thread_ring_io->ring);
+         if (ring_enter(&thread_ring_io->ring, 1) < 0) break;
+         ring_reap(thread_ring_io);
+      } else {
+         struct pollfd pfd = {.fd = out->fd, .events = POLLOUT};
+         poll(&pfd, 1, -1);
+      }
+   }
+}
+
+void sink_close(output_sink *out) {
+   sink_drain(out);
+   if (out->owned && thread_ring_io != NULL) ring_sync(thread_ring_io); // Writes to fd may still be in flight
+   if (out->map != NULL) munmap(out->map, out->size);
+   if (out->owned) close(out->fd);
+   free(out->queue);
+   out->queue = NULL;
+   out->queue_cap = 0;
+   out->map = NULL;
+   out->owned = false;
+}
+
+// Sizes the output file to what the peer announced and maps it, so packets can be placed by offset.
+// Stays in streaming mode if that isn't possible (e.g. the output is a pipe).
+void sink_map(output_sink *out, uint64_t size, uint32_t base) {
+   out->base = base;
+   out->base_off = 0;
+   if (size == 0 || !out->owned || ftruncate(out->fd, size) < 0) return;
+   void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, 0);
+   if (map == MAP_FAILED) return;
+   out->map = map;
+   out->size = size;
+   LOG(LOG_INFO, "Writing %" PRIu64 " byte file from peer by offset.\n", size);
+}
+
+// Appends in-order data when streaming. It is queued, and sink_flush() writes it out once per loop iteration;
+// with io_uring it goes straight into the output chunks while they have room. If the queue can't grow the sink
+// is marked failed and drops everything from then on.
+void sink_write(output_sink *out, const uint8_t *data, int len) {
+   if (out->failed) return;
+   out->digest = crc32c(out->digest, data, len);
+   if (thread_ring_io != NULL && sink_queued(out) == 0) {
+      int n = ring_write_room(&thread_ring_io->ring, out->fd);
+      if (n > len) n = len;
+      ring_write(thread_ring_io, out->fd, data, n);
+      data += n;
+      len -= n;
+   }
+   if (len == 0) return;
+   if (out->queue_len + len > out->queue_cap && out->queue_off > 0) {
+      memmove(out->queue, out->queue + out->queue_off, sink_queued(out));
+      out->queue_len -= out->queue_off;
+      out->queue_off = 0;
+   }
+   if (out->queue_len + len > out->queue_cap) {
+      int cap = out->queue_cap > 0 ? 2 * out->queue_cap : RING_CHUNK;
+      while (cap < out->queue_len + len) cap *= 2;
+      uint8_t *queue = realloc(out->queue, cap);
+      if (queue == NULL) {
+         fprintf(stderr, "Failed to allocate output queue.\n");
+         out->failed = true;
+         return;
+      }
+      out->queue = queue;
+      out->queue_cap = cap;
+   }
+   memcpy(out->queue + out->queue_len, data, len);
+   out->queue_len += len;
+}
+
+// Reads up to len bytes of stdin (which is non-blocking); like read()
+int source_read(input_source *src, uint8_t *buf, int len) {
+   int n = thread_ring_io != NULL ? ring_read(thread_ring_io, src->fd, buf, len) : read(src->fd, buf, len);
+   if (n > 0) src->digest = crc32c(src->digest, buf, n);
+   return n;
+}
+
+// CRC32C of everything we send from src: the whole file, or the stdin data read so far
+uint32_t source_digest(input_source *src) {
+   return src->map != NULL ? crc32c(0, src->map, src->size) : src->digest;
+}
+
+// File offset of a byte at or after the last exp_seq passed to sink_check_done()
+uint64_t sink_offset(output_sink *out, uint32_t seq) {
+   return out->base_off + (uint32_t)(seq - out->base);
+}
+
+// Called once everything up to exp_seq has arrived; flushes a mapped file when it is complete
+void sink_check_done(output_sink *out, uint32_t exp_seq) {
+   if (out->map == NULL || out->done) return;
+   out->base_off = sink_offset(out, exp_seq);
+   out->base = exp_seq;
+   if (out->base_off < out->size) return;
+   msync(out->map, out->size, MS_ASYNC);
+   out->digest = crc32c(0, out->map, out->size);
+   out->done = true;
+   LOG(LOG_INFO, "Received all %" PRIu64 " bytes of the peer's file.\n", out->size);
+}
+
+// Extra bytes lz_compress needs to store a literal count or match length of n
+int lz_length_bytes(int n) {
+   return n < 15 ? 0 : (n - 15) / 255 + 1;
+}
+
+// Writes the extra length bytes for n at dst[op]; returns the new op
+int lz_put_length(uint8_t *dst, int op, int n) {
+   if (n < 15) return op;
+   for (n -= 15; n >= 255; n -= 255) dst[op++] = 255;
+   dst[op++] = n;
+   return op;
+}
+
+// Adds the extra length bytes at src[ip] to *n; returns the new ip, or -1 if they run past the end
+int lz_get_length(const uint8_t *src, int ip, int src_len, int *n) {
+   int b;
+   do {
+      if (ip >= src_len) return -1;
+      b = src[ip++];
+      *n += b;
+   } while (b == 255);
+   return ip;
+}
+
+// Compresses a prefix of src (at most 64KB) into at most dst_cap bytes, LZ4 style: each sequence is a token
+// holding the literal count and match length - LZ_MIN_MATCH (a nibble each, 15 meaning length bytes follow),
+// the literals, then a 2 byte little endian match offset. The last sequence may end after its literals.
+// Returns the compressed length and sets *consumed to how much of src it covers.
+int lz_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap, int *consumed) {
+   uint16_t table[1 << LZ_HASH_BITS] = {0}; // Last position each hash of 4 bytes was seen at
+   int ip = 0, anchor = 0, op = 0;
+   while (ip + LZ_MIN_MATCH <= src_len) {
+      uint32_t word;
+      memcpy(&word, src + ip, sizeof(word));
+      uint32_t h = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+      int ref = table[h];
+      table[h] = ip;
+      if (ref >= ip || memcmp(src + ref, src + ip, LZ_MIN_MATCH) != 0) {
+         ip += 1 + ((ip - anchor) >> 6); // Skip faster through data that isn't compressing
+         continue;
+      }
+      int len = LZ_MIN_MATCH;
+      while (ip + len < src_len && src[ref + len] == src[ip + len]) len++;
+      int lit = ip - anchor;
+      int cost = 1 + lz_length_bytes(lit) + lit + 2 + lz_length_bytes(len - LZ_MIN_MATCH);
+      if (op + cost > dst_cap) break;
+      int m = len - LZ_MIN_MATCH;
+      dst[op++] = (lit < 15 ? lit : 15) << 4 | (m < 15 ? m : 15);
+      op = lz_put_length(dst, op, lit);
+      memcpy(dst + op, src + anchor, lit);
+      op += lit;
+      dst[op++] = (ip - ref) & 0xff;
+      dst[op++] = (ip - ref) >> 8;
+      op = lz_put_length(dst, op, m);
+      ip += len;
+      anchor = ip;
+   }
+   // Finish with as many of the remaining bytes as fit as literals
+   int room = dst_cap - op;
+   int lit = src_len - anchor < room - 1 ? src_len - anchor : room - 1;
+   while (lit > 0 && 1 + lz_length_bytes(lit) + lit > room) lit--;
+   if (lit < 0) lit = 0;
+   if (lit > 0) {
+      dst[op++] = (lit < 15 ? lit : 15) << 4;
+      op = lz_put_length(dst, op, lit);
+      memcpy(dst + op, src + anchor, lit);
+      op += lit;
+   }
+   *consumed = anchor + lit;
+   return op;
+}
+
+// Decompresses what lz_compress produced into at most dst_cap bytes; returns the length, or -1 if src is corrupt
+int lz_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap) {
+   int ip = 0, op = 0;
+   while (ip < src_len) {
+      int token = src[ip++];
+      int lit = token >> 4;
+      if (lit == 15 && (ip = lz_get_length(src, ip, src_len, &lit)) < 0) return -1;
+      if (lit > src_len - ip || lit > dst_cap - op) return -1;
+      memcpy(dst + op, src + ip, lit);
+      ip += lit;
+      op += lit;
+      if (ip == src_len) break;
+      if (src_len - ip < 2) return -1;
+      int offset = src[ip] | src[ip + 1] << 8;
+      ip += 2;
+      int len = token & 15;
+      if (len == 15 && (ip = lz_get_length(src, ip, src_len, &len)) < 0) return -1;
+      len += LZ_MIN_MATCH;
+      if (offset == 0 || offset > op || len > dst_cap - op) return -1;
+      if (offset >= len) {
+         memcpy(dst + op, dst + op - offset, len);
+      } else {
+         for (int i = 0; i < len; i++) dst[op + i] = dst[op - offset + i]; // Overlapping copies repeat the pattern
+      }
+      op += len;
+   }
+   return op;
+}
+
+// Writes a data packet's payload (after any stream frame) to out, decompressing it first if the sender compressed
+// it. Every compressed packet stands alone, so this works on whatever order the packets are released in.
+void sink_deliver(output_sink *out, packet *pkt) {
+   static __thread uint8_t buf[COMP_MAX_INPUT];
+   int head = pkt->unused & EXT_STREAM ? STREAM_FRAME_LEN : 0;
+   if (!(pkt->unused & EXT_COMP)) {
+      sink_write(out, pkt->payload + head, ntohs(pkt->length) - head);
+      return;
+   }
+   int len = lz_decompress(pkt->payload + head, ntohs(pkt->length) - head, buf, sizeof(buf));
+   if (len < 0) {
+      fprintf(stderr, "Dropping corrupt compressed packet (SEQ=%u).\n", ntohl(pkt->seq));
+      return;
+   }
+   sink_write(out, buf, len);
+}
+
+// Appends a handshake option (type, length, value) after the packet's data; returns the new datagram length
+int add_option(packet *pkt, int pkt_len, uint8_t type, const void *val, uint8_t len) {
+   if (pkt_len + 2 + len > (int)sizeof(packet)) return pkt_len;
+   uint8_t *opt = (uint8_t *)pkt + pkt_len;
+   opt[0] = type;
+   opt[1] = len;
+   memcpy(opt + 2, val, len);
+   pkt->unused |= EXT_OPTS;
+   return pkt_len + 2 + len;
+}
+
+// Finds a handshake option in a received SYN or SYN-ACK; returns its value (setting *len) or NULL
+const uint8_t *find_option(packet *pkt, int pkt_len, uint8_t type, int *len) {
+   if (!(pkt->unused & EXT_OPTS)) return NULL;
+   int off = HEADER_LEN + ntohs(pkt->length);
+   const uint8_t *buf = (const uint8_t *)pkt;
+   while (off + 2 <= pkt_len && off + 2 + buf[off + 1] <= pkt_len) {
+      if (buf[off] == type) {
+         *len = buf[off + 1];
+         return buf + off + 2;
+      }
+      off += 2 + buf[off + 1];
+   }
+   return NULL;
+}
+
+// Size of the file the peer is sending (0 if it is streaming)
+uint64_t peer_file_size(packet *pkt, int pkt_len) {
+   int len;
+   const uint8_t *val = find_option(pkt, pkt_len, OPT_FILE_SIZE, &len);
+   uint64_t size = 0;
+   if (val == NULL || len != sizeof(size)) return 0;
+   memcpy(&size, val, sizeof(size));
+   return be64toh(size);
+}
+
+// Adds our file size (if sending a --file) to a handshake packet; returns the new datagram length
+int add_file_size(packet *pkt, int pkt_len, input_source *src) {
+   if (src->map == NULL) return pkt_len;
+   uint64_t size = htobe64(src->size);
+   return add_option(pkt, pkt_len, OPT_FILE_SIZE, &size, sizeof(size));
+}
+
+// Largest payload the peer can receive, from its handshake options
+int peer_max_payload(packet *pkt, int pkt_len) {
+   int len;
+   const uint8_t *val = find_option(pkt, pkt_len, OPT_MAX_PAYLOAD, &len);
+   if (val == NULL || len != 2) return MSS;
+   int max = val[0] << 8 | val[1];
+   return max < MSS ? MSS : max > MAX_MSS ? MAX_MSS : max;
+}
+
+// Advertises the largest payload we can receive; returns the new datagram length
+int add_max_payload(packet *pkt, int pkt_len, int max) {
+   uint8_t val[2] = {max >> 8, max & 0xff};
+   return max > MSS ? add_option(pkt, pkt_len, OPT_MAX_PAYLOAD, val, sizeof(val)) : pkt_len;
+}
+
+// Streams the peer sends in stream frames (counting stream 0), from its handshake options; 0 if it doesn't
+int peer_streams(packet *pkt, int pkt_len) {
+   int len;
+   const uint8_t *val = find_option(pkt, pkt_len, OPT_STREAMS, &len);
+   if (val == NULL || len != 2) return 0;
+   int n = val[0] << 8 | val[1];
+   return n > MAX_STREAMS + 1 ? 0 : n;
+}
+
+// Announces that we send our num_streams --stream files (plus stream 0) in stream frames; returns the new datagram length
+int add_streams(packet *pkt, int pkt_len, int num_streams) {
+   uint8_t val[2] = {(num_streams + 1) >> 8, (num_streams + 1) & 0xff};
+   return num_streams > 0 ? add_option(pkt, pkt_len, OPT_STREAMS, val, sizeof(val)) : pkt_len;
+}
+
+// Stream frame at the start of a data packet's payload: which stream the rest belongs to, and where in it
+void frame_write(packet *pkt, int stream, uint32_t off) {
+   pkt->payload[0] = stream >> 8;
+   pkt->payload[1] = stream & 0xff;
+   off = htonl(off);
+   memcpy(pkt->payload + 2, &off, 4);
+}
+
+int frame_stream(packet *pkt) {
+   return pkt->payload[0] << 8 | pkt->payload[1];
+}
+
+uint32_t frame_offset(packet *pkt) {
+   uint32_t off;
+   memcpy(&off, pkt->payload + 2, 4);
+   return ntohl(off);
+}
+
+// Send window: unacked packets in seq order, stored in a ring so acks pop from the front in O(1)
+typedef struct {
+   packet **pkts; // cap pool buffers, NULL until a slot is first used
+   pkt_pool *pool;
+   int max_payload; // Largest payload we send
+   const uint8_t **data; // Where the payload lives if it isn't in pkts (a mapped --file), else NULL
+   uint64_t *sent_times;
+   bool *retransmitted;
+   bool *sacked; // Peer already has the packet, it is only waiting on a cumulative ack
+   int *retx_episode; // Episode in which the packet was last retransmitted
+   int cap;
+   int head; // Slot of the packet with the lowest seq num
+   int count;
+   uint32_t high_sacked; // One past the highest seq num the peer has SACKed
+   int episode; // Bumped on every timeout or new fast recovery, so each hole is resent once per episode
+} send_window;
+
+// Receive window: out of order packets in a hash table keyed by seq num (linear probing), so lookups are
+// O(1) whatever size the peer's packets are. Slots hold pool buffers, so buffering a packet takes a reference.
+// When the peer sends stream frames, packets are delivered in order per stream instead: the table holds the
+// packets each stream is still waiting on, keyed by stream and offset, and the blocks track what has arrived.
+typedef struct {
+   packet **pkts; // slots pool buffers, NULL where free
+   pkt_pool *pool;
+   int max_payload; // Largest payload the peer sends
+   int slots;
+   int count;
+   sack_block blocks[MAX_SACK_BLOCKS]; // Ranges of buffered packets, sorted by seq num
+   int num_blocks;
+   int num_streams; // Streams the peer sends, 0 if it doesn't use stream frames
+   uint32_t *stream_next; // Offset each stream delivers next
+   output_sink *stream_out; // Where streams 1 and up go; stream 0 goes to the connection's output
+   int held_bytes; // Payload of the packets in the table
+   packet **fec_cache; // Recent data and parity packets (FEC_CACHE_SIZE pool buffers), NULL unless the peer sends parity
+   int fec_cache_next;
+   uint64_t fec_rebuilt; // Packets rebuilt from parity
+   uint64_t window_drops; // Data packets dropped for lying past the window edge
+} recv_window;
+
+void send_window_init(send_window *sw, int cap, int max_payload, pkt_pool *pool) {
+   sw->pool = pool;
+   sw->max_payload = max_payload;
+   sw->pkts = calloc(cap, sizeof(packet *));
+   sw->data = malloc(cap * sizeof(const uint8_t *));
+   sw->sent_times = malloc(cap * sizeof(uint64_t));
+   sw->retransmitted = malloc(cap * sizeof(bool));
+   sw->sacked = malloc(cap * sizeof(bool));
+   sw->retx_episode = malloc(cap * sizeof(int));
+   if (sw->pkts == NULL || sw->data == NULL || sw->sent_times == NULL || sw->retransmitted == NULL || sw->sacked == NULL || sw->retx_episode == NULL) {
+      fprintf(stderr, "Failed to allocate send window.\n");
+      exit(1);
+   }
+   sw->cap = cap;
+   sw->head = 0;
+   sw->count = 0;
+   sw->high_sacked = 0;
+   sw->episode = 1;
+}
+
+void send_window_free(send_window *sw) {
+   for (int i = 0; i < sw->cap; i++) pool_put(sw->pkts[i]);
+   free(sw->pkts);
+   free(sw->data);
+   free(sw->sent_times);
+   free(sw->retransmitted);
+   free(sw->sacked);
+   free(sw->retx_episode);
+}
+
+// Returns the slot of the i-th oldest packet in the send window
+int send_window_slot(send_window *sw, int i) {
+   return (sw->head + i) % sw->cap;
+}
+
+packet *send_window_pkt(send_window *sw, int slot) {
+   return sw->pkts[slot];
+}
+
+// Returns the free slot the next packet should be built in, or NULL if the window is full.
+// The packet only joins the window once send_window_commit() is called.
+packet *send_window_next(send_window *sw) {
+   if (sw->count >= sw->cap) return NULL;
+   int slot = send_window_slot(sw, sw->count);
+   // A queued send of the slot's last packet may still hold its buffer
+   sw->pkts[slot] = pool_unshare(sw->pool, sw->pkts[slot]);
+   return sw->pkts[slot];
+}
+
+// data points at the payload if it wasn't written into the slot's packet
+void send_window_commit(send_window *sw, const uint8_t *data) {
+   int slot = send_window_slot(sw, sw->count);
+   sw->data[slot] = data;
+   sw->sent_times[slot] = now_us();
+   sw->retransmitted[slot] = false;
+   sw->sacked[slot] = false;
+   sw->retx_episode[slot] = 0;
+   sw->count++;
+}
+
+// Returns index (from the front) of the first packet whose seq num is >= seq.
+// Every packet but the last in a run of stdin reads is full size, so the first guess is almost always right.
+int send_window_index(send_window *sw, uint32_t seq) {
+   if (sw->count == 0) return 0;
+   uint32_t front_seq = ntohl(send_window_pkt(sw, sw->head)->seq);
+   if ((int32_t)(seq - front_seq) <= 0) return 0;
+   int i = (seq - front_seq) / sw->max_payload;
+   if (i > sw->count) i = sw->count;
+   while (i > 0 && (int32_t)(ntohl(send_window_pkt(sw, send_window_slot(sw, i - 1))->seq) - seq) >= 0) i--;
+   while (i < sw->count && (int32_t)(ntohl(send_window_pkt(sw, send_window_slot(sw, i))->seq) - seq) < 0) i++;
+   return i;
+}
+
+// Returns slot of packet with the given seq num, or -1 if it is not in the window.
+int send_window_find(send_window *sw, uint32_t seq) {
+   int i = send_window_index(sw, seq);
+   if (i >= sw->count) return -1;
+   int slot = send_window_slot(sw, i);
+   return ntohl(send_window_pkt(sw, slot)->seq) == seq ? slot : -1;
+}
+
+// Marks the packets covered by the SACK blocks in an ack's payload so they aren't retransmitted
+void send_window_sack(send_window *sw, packet *pkt, int pkt_len) {
+   uint32_t *blocks = (uint32_t *)pkt->payload;
+   int num_blocks = (pkt_len - HEADER_LEN) / 8;
+   for (int b = 0; b < num_blocks; b++) {
+      uint32_t start = ntohl(blocks[2 * b]);
+      uint32_t end = ntohl(blocks[2 * b + 1]);
+      if ((int32_t)(end - sw->high_sacked) > 0) sw->high_sacked = end;
+      for (int i = send_window_index(sw, start); i < sw->count; i++) {
+         int slot = send_window_slot(sw, i);
+         if ((int32_t)(ntohl(send_window_pkt(sw, slot)->seq) + ntohs(send_window_pkt(sw, slot)->length) - end) > 0) break;
+         sw->sacked[slot] = true;
+      }
+   }
+}
+
+void retransmit_slot(send_window *sw, io_layer *io, struct sockaddr_in *addr, int slot) {
+   packet *p = send_window_pkt(sw, slot);
+   if (sw->data[slot] != NULL) {
+      io_queue(io, p, ntohs(p->length) + HEADER_LEN, sw->data[slot], addr);
+   } else {
+      io_queue_ref(io, p, ntohs(p->length) + HEADER_LEN, addr);
+   }
+   TRACE("Retransmitting packet %u.", ntohl(p->seq));
+   sw->retransmitted[slot] = true;
+   sw->retx_episode[slot] = sw->episode;
+}
+
+// Resends the lowest packet plus the packets the peer's SACK blocks show are missing, skipping any already
+// resent this episode. Holes are only filled while fewer than budget packets are estimated to be in the
+// network (RFC 6675's pipe), so the rest go out as acks drain it. Returns the number of packets sent.
+int retransmit_holes(send_window *sw, io_layer *io, struct sockaddr_in *addr, int budget) {
+   // Unsacked packets above the highest SACK are still in flight, holes below it are lost unless resent
+   int pipe = 0;
+   for (int i = 0; i < sw->count; i++) {
+      int slot = send_window_slot(sw, i);
+      if (sw->sacked[slot]) continue;
+      if ((int32_t)(ntohl(send_window_pkt(sw, slot)->seq) - sw->high_sacked) >= 0 || sw->retx_episode[slot] == sw->episode) pipe++;
+   }
+   int sent = 0;
+   for (int i = 0; i < sw->count; i++) {
+      int slot = send_window_slot(sw, i);
+      if (i > 0 && (int32_t)(ntohl(send_window_pkt(sw, slot)->seq) - sw->high_sacked) >= 0) break;
+      if (sw->sacked[slot] || sw->retx_episode[slot] == sw->episode) continue;
+      if (i > 0 && pipe >= budget) break;
+      retransmit_slot(sw, io, addr, slot);
+      sent++;
+      pipe++;
+   }
+   return sent;
+}
+
+// After a timeout every packet sent before it (below recover_seq) is presumed lost. Resends the ones not
+// yet resent this episode, keeping at most budget resent packets in flight. Returns the number sent.
+int retransmit_lost(send_window *sw, io_layer *io, struct sockaddr_in *addr, int budget, uint32_t recover_seq) {
+   int in_flight = 0;
+   int sent = 0;
+   for (int i = 0; i < sw->count && in_flight < budget; i++) {
+      int slot = send_window_slot(sw, i);
+      if ((int32_t)(ntohl(send_window_pkt(sw, slot)->seq) - recover_seq) >= 0) break;
+      if (sw->sacked[slot]) continue;
+      if (sw->retx_episode[slot] != sw->episode) {
+         retransmit_slot(sw, io, addr, slot);
+         sent++;
+      }
+      in_flight++;
+   }
+   return sent;
+}
+
+// Returns slot of packet with lowest seq num; returns -1 if buffer is empty
+int get_lowest_pkt(send_window *sw) {
+   return sw->count > 0 ? sw->head : -1;
+}
+
+// Twice our window worth of slots to start with, so the table stays at most half full
+void recv_window_init(recv_window *rw, int window, int max_payload, pkt_pool *pool) {
+   rw->slots = 2 * window;
+   rw->pool = pool;
+   rw->max_payload = max_payload;
+   rw->pkts = calloc(rw->slots, sizeof(packet *));
+   if (rw->pkts == NULL) {
+      fprintf(stderr, "Failed to allocate receive window.\n");
+      exit(1);
+   }
+   rw->count = 0;
+   rw->held_bytes = 0;
+   rw->num_blocks = 0;
+   rw->num_streams = 0;
+   rw->stream_next = NULL;
+   rw->stream_out = NULL;
+   rw->fec_cache = NULL;
+   rw->fec_cache_next = 0;
+   rw->fec_rebuilt = 0;
+   rw->window_drops = 0;
+}
+
+void recv_window_free(recv_window *rw) {
+   for (int i = 0; i < rw->slots; i++) pool_put(rw->pkts[i]);
+   for (int i = 0; rw->fec_cache != NULL && i < FEC_CACHE_SIZE; i++) pool_put(rw->fec_cache[i]);
+   for (int i = 1; i < rw->num_streams; i++) sink_close(&rw->stream_out[i - 1]);
+   free(rw->pkts);
+   free(rw->fec_cache);
+   free(rw->stream_next);
+   free(rw->stream_out);
+}
+
+// Sets the window up for a peer that sends n streams in stream frames. Stream i > 0 goes to base.i, or to
+// stream.i in the current directory when base is NULL.
+void recv_window_streams(recv_window *rw, int n, const char *base) {
+   rw->num_streams = n;
+   rw->stream_next = calloc(n, sizeof(uint32_t));
+   rw->stream_out = calloc(n, sizeof(output_sink));
+   if (rw->stream_next == NULL || rw->stream_out == NULL) {
+      fprintf(stderr, "Failed to allocate streams.\n");
+      exit(1);
+   }
+   for (int i = 1; i < n; i++) {
+      char path[4096];
+      snprintf(path, sizeof(path), "%s.%d", base != NULL ? base : "stream", i);
+      sink_open(&rw->stream_out[i - 1], path);
+   }
+   LOG(LOG_INFO, "Peer sends %d streams.\n", n);
+}
+
+// Records [start, end) as received, merging it with any blocks it touches
+void sack_add(recv_window *rw, uint32_t start, uint32_t end) {
+   int i = 0;
+   while (i < rw->num_blocks && (int32_t)(rw->blocks[i].end - start) < 0) i++;
+   if (i < rw->num_blocks && (int32_t)(rw->blocks[i].start - end) <= 0) {
+      // Extend block i, then absorb the blocks after it that now touch it
+      if ((int32_t)(start - rw->blocks[i].start) < 0) rw->blocks[i].start = start;
+      if ((int32_t)(end - rw->blocks[i].end) > 0) rw->blocks[i].end = end;
+      int j = i + 1;
+      while (j < rw->num_blocks && (int32_t)(rw->blocks[j].start - rw->blocks[i].end) <= 0) {
+         if ((int32_t)(rw->blocks[j].end - rw->blocks[i].end) > 0) rw->blocks[i].end = rw->blocks[j].end;
+         j++;
+      }
+      memmove(&rw->blocks[i + 1], &rw->blocks[j], (rw->num_blocks - j) * sizeof(sack_block));
+      rw->num_blocks -= j - i - 1;
+      return;
+   }
+   if (rw->num_blocks == MAX_SACK_BLOCKS) {
+      if (i == rw->num_blocks) return; // The sender learns about it once the lower holes are filled
+      rw->num_blocks--; // Forget the highest block to make room
+   }
+   memmove(&rw->blocks[i + 1], &rw->blocks[i], (rw->num_blocks - i) * sizeof(sack_block));
+   rw->blocks[i].start = start;
+   rw->blocks[i].end = end;
+   rw->num_blocks++;
+}
+
+// Writes our SACK blocks into the payload of a pure ack; returns the number of bytes added
+int recv_window_write_sack(recv_window *rw, packet *pkt) {
+   uint32_t *out = (uint32_t *)pkt->payload;
+   for (int i = 0; i < rw->num_blocks; i++) {
+      out[2 * i] = htonl(rw->blocks[i].start);
+      out[2 * i + 1] = htonl(rw->blocks[i].end);
+   }
+   if (rw->num_blocks > 0) pkt->unused |= EXT_SACK;
+   return rw->num_blocks * 8;
+}
+
+packet *recv_window_pkt(recv_window *rw, int slot) {
+   return rw->pkts[slot];
+}
+
+// What a buffered packet is looked up by: its stream and offset if it has a stream frame, else its seq num
+uint64_t recv_window_key(packet *pkt) {
+   if (!(pkt->unused & EXT_STREAM)) return ntohl(pkt->seq);
+   return (uint64_t)frame_stream(pkt) << 32 | frame_offset(pkt);
+}
+
+// Slot the search for key starts at
+int recv_window_home(recv_window *rw, uint64_t key) {
+   return ((uint32_t)(key ^ key >> 32) * 2654435761u) % rw->slots;
+}
+
+// Returns the slot holding the packet with this key, or -1 if it isn't buffered
+int recv_window_find(recv_window *rw, uint64_t key) {
+   for (int slot = recv_window_home(rw, key); rw->pkts[slot] != NULL; slot = (slot + 1) % rw->slots) {
+      if (recv_window_key(rw->pkts[slot]) == key) return slot;
+   }
+   return -1;
+}
+
+// Frees a slot, moving back later packets that probed past it so every packet stays reachable from its home
+void recv_window_remove(recv_window *rw, int slot) {
+   rw->held_bytes -= ntohs(rw->pkts[slot]->length);
+   pool_put(rw->pkts[slot]);
+   rw->pkts[slot] = NULL;
+   rw->count--;
+   for (int next = (slot + 1) % rw->slots; rw->pkts[next] != NULL; next = (next + 1) % rw->slots) {
+      int home = recv_window_home(rw, recv_window_key(rw->pkts[next]));
+      // Leave it if its home lies cyclically in (slot, next]
+      if (slot < next ? (home > slot && home <= next) : (home > slot || home <= next)) continue;
+      rw->pkts[slot] = rw->pkts[next];
+      rw->pkts[next] = NULL;
+      slot = next;
+   }
+}
+
+// Doubles the table and rehashes every packet into it. Returns false if it is already as large as it gets, or
+// there is no memory for a larger one.
+bool recv_window_grow(recv_window *rw) {
+   if (rw->slots >= 2 * MAX_WINDOW_SIZE) return false;
+   packet **old = rw->pkts;
+   int old_slots = rw->slots;
+   rw->pkts = calloc(2 * old_slots, sizeof(packet *));
+   if (rw->pkts == NULL) {
+      fprintf(stderr, "Failed to grow receive window.\n");
+      rw->pkts = old;
+      return false;
+   }
+   rw->slots *= 2;
+   for (int i = 0; i < old_slots; i++) {
+      if (old[i] == NULL) continue;
+      int slot = recv_window_home(rw, recv_window_key(old[i]));
+      while (rw->pkts[slot] != NULL) slot = (slot + 1) % rw->slots;
+      rw->pkts[slot] = old[i];
+   }
+   free(old);
+   return true;
+}
+
+// Buffers an out of order packet; returns false if there was no room for it.
+// A peer with a larger --window can have more packets in flight than the table was sized for, so it grows
+// rather than dropping them. What it holds in bytes is bounded by the advertised receive window.
+bool recv_window_add(recv_window *rw, packet *pkt) {
+   uint64_t key = recv_window_key(pkt);
+   if (recv_window_find(rw, key) >= 0) return true; // Duplicate
+   if (rw->count >= rw->slots / 2 && !recv_window_grow(rw)) {
+      TRACE("Buffer full- dropping packet %u.", ntohl(pkt->seq));
+      return false;
+   }
+   int slot = recv_window_home(rw, key);
+   while (rw->pkts[slot] != NULL) slot = (slot + 1) % rw->slots;
+   rw->pkts[slot] = pool_hold(rw->pool, pkt, HEADER_LEN + ntohs(pkt->length));
+   rw->count++;
+   rw->held_bytes += ntohs(pkt->length);
+   return true;
+}
+
+// Records [start, end) as received and moves exp_seq past everything that has now arrived without a gap
+void recv_window_advance(recv_window *rw, uint32_t start, uint32_t end, uint32_t *exp_seq) {
+   sack_add(rw, start, end);
+   while (rw->num_blocks > 0 && (int32_t)(rw->blocks[0].start - *exp_seq) <= 0) {
+      if ((int32_t)(rw->blocks[0].end - *exp_seq) > 0) *exp_seq = rw->blocks[0].end;
+      memmove(&rw->blocks[0], &rw->blocks[1], (rw->num_blocks - 1) * sizeof(sack_block));
+      rw->num_blocks--;
+   }
+}
+
+// Hands a data packet to its stream: delivers it if it is what that stream waits for next (then anything buffered
+// that now follows it), else buffers it. Only a loss in the same stream holds a packet up. out is where stream 0
+// goes. Returns false if the packet had to be dropped for lack of room.
+bool stream_recv(recv_window *rw, output_sink *out, packet *pkt) {
+   int len = ntohs(pkt->length) - STREAM_FRAME_LEN;
+   if (!(pkt->unused & EXT_STREAM) || len < 0 || frame_stream(pkt) >= rw->num_streams) return true; // Not from a stream we know
+   int id = frame_stream(pkt);
+   uint32_t off = frame_offset(pkt);
+   if ((int32_t)(off - rw->stream_next[id]) < 0) return true; // Already delivered
+   if (off != rw->stream_next[id]) return recv_window_add(rw, pkt);
+   output_sink *dst = id == 0 ? out : &rw->stream_out[id - 1];
+   sink_deliver(dst, pkt);
+   rw->stream_next[id] += len;
+   while (rw->count > 0) {
+      int slot = recv_window_find(rw, (uint64_t)id << 32 | rw->stream_next[id]);
+      if (slot < 0) break;
+      sink_deliver(dst, recv_window_pkt(rw, slot));
+      rw->stream_next[id] += ntohs(recv_window_pkt(rw, slot)->length) - STREAM_FRAME_LEN;
+      recv_window_remove(rw, slot);
+   }
+   return true;
+}
+
+// GF(2^8) arithmetic for FEC parity (polynomial 0x11d)
+uint8_t gf_exp[512];
+uint8_t gf_log[256];
+uint8_t gf_nibble[256][2][16]; // c * x for the low and high nibble x of a byte, for table lookup kernels
+uint8_t fec_coef[FEC_MAX_PARITY][FEC_MAX_GROUP]; // Parity j adds fec_coef[j][i] * data packet i
+const char *gf_kernel = "scalar";
+
+uint8_t gf_mul(uint8_t a, uint8_t b) {
+   return a == 0 || b == 0 ? 0 : gf_exp[gf_log[a] + gf_log[b]];
+}
+
+uint8_t gf_inv(uint8_t a) {
+   return gf_exp[255 - gf_log[a]];
+}
+
+// dst ^= c * src over len bytes
+void gf_mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, int len) {
+   const uint8_t *lo = gf_nibble[c][0], *hi = gf_nibble[c][1];
+   for (int i = 0; i < len; i++) dst[i] ^= lo[src[i] & 15] ^ hi[src[i] >> 4];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Same as gf_mul_add_scalar, 16 bytes at a time: pshufb looks up both nibble tables in one instruction each
+__attribute__((target("ssse3")))
+void gf_mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, int len) {
+   __m128i lo = _mm_loadu_si128((const __m128i *)gf_nibble[c][0]);
+   __m128i hi = _mm_loadu_si128((const __m128i *)gf_nibble[c][1]);
+   __m128i mask = _mm_set1_epi8(0x0f);
+   int i = 0;
+   for (; i + 16 <= len; i += 16) {
+      __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+      __m128i p = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(s, mask)),
+                                _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + i)), p));
+   }
+   gf_mul_add_scalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+void (*gf_mul_add)(uint8_t *dst, const uint8_t *src, uint8_t c, int len) = gf_mul_add_scalar;
+
+// Builds the tables and picks the fastest kernel the CPU supports; call once before any threads start
+void gf_init(void) {
+   int x = 1;
+   for (int i = 0; i < 255; i++) {
+      gf_exp[i] = gf_exp[i + 255] = x;
+      gf_log[x] = i;
+      x <<= 1;
+      if (x & 0x100) x ^= 0x11d;
+   }
+   for (int c = 0; c < 256; c++) {
+      for (int n = 0; n < 16; n++) {
+         gf_nibble[c][0][n] = gf_mul(c, n);
+         gf_nibble[c][1][n] = gf_mul(c, n << 4);
+      }
+   }
+   // A Cauchy matrix 1 / (x_j + y_i), so any square submatrix is invertible and any K losses in a group can be
+   // rebuilt from K parity packets. Scaling each column makes the first parity a plain XOR.
+   for (int j = 0; j < FEC_MAX_PARITY; j++) {
+      for (int i = 0; i < FEC_MAX_GROUP; i++) {
+         fec_coef[j][i] = gf_mul(gf_inv((FEC_MAX_GROUP + j) ^ i), FEC_MAX_GROUP ^ i);
+      }
+   }
+#if defined(__x86_64__) || defined(__i386__)
+   if (__builtin_cpu_supports("ssse3")) {
+      gf_mul_add = gf_mul_add_ssse3;
+      gf_kernel = "ssse3";
+   }
+#endif
+}
+
+// Inverts the n x n matrix a in place (Gauss-Jordan); returns false if it is singular
+bool gf_invert(uint8_t a[FEC_MAX_PARITY][FEC_MAX_PARITY], int n) {
+   uint8_t inv[FEC_MAX_PARITY][FEC_MAX_PARITY] = {{0}};
+   for (int i = 0; i < n; i++) inv[i][i] = 1;
+   for (int col = 0; col < n; col++) {
+      int pivot = col;
+      while (pivot < n && a[pivot][col] == 0) pivot++;
+      if (pivot == n) return false;
+      for (int k = 0; k < n; k++) {
+         uint8_t t = a[col][k]; a[col][k] = a[pivot][k]; a[pivot][k] = t;
+         t = inv[col][k]; inv[col][k] = inv[pivot][k]; inv[pivot][k] = t;
+      }
+      uint8_t scale = gf_inv(a[col][col]);
+      for (int k = 0; k < n; k++) {
+         a[col][k] = gf_mul(a[col][k], scale);
+         inv[col][k] = gf_mul(inv[col][k], scale);
+      }
+      for (int row = 0; row < n; row++) {
+         uint8_t f = a[row][col];
+         if (row == col || f == 0) continue;
+         for (int k = 0; k < n; k++) {
+            a[row][k] ^= gf_mul(f, a[col][k]);
+            inv[row][k] ^= gf_mul(f, inv[col][k]);
+         }
+      }
+   }
+   memcpy(a, inv, sizeof(inv));
+   return true;
+}
+
+// Sender side of FEC. Consecutive data packets form groups of n; each group is followed by k parity packets
+// whose payload is [n][k][j][0], the n payload lengths (top bit set if compressed), then parity j of the
+// payloads, each zero padded to the longest. Their header carries the group's first seq num and EXT_FEC.
+typedef struct {
+   int n; // Data packets per group, 0 if FEC is off
+   int max_k;
+   int k; // Parity packets for the current group, adapted to the loss rate
+   int count; // Data packets in the current group so far
+   uint32_t first_seq;
+   uint16_t lengths[FEC_MAX_GROUP];
+   int region; // Longest payload in the current group
+   uint64_t deadline; // When a partial group is sent anyway, 0 if no group is open
+   packet *parity[FEC_MAX_PARITY]; // Pool buffers, NULL until first used
+   pkt_pool *pool;
+   int max_payload;
+   bool csum; // Parity gets a checksum trailer
+   int clean_groups; // Groups in a row during which nothing had to be retransmitted
+   uint64_t retransmits; // Retransmissions so far, as of the last group
+} fec_encoder;
+
+// Adds a data packet to the current group; data is its payload after any stream frame if that isn't in pkt
+// (a mapped file), else NULL. Returns true once the group is full.
+bool fec_add(fec_encoder *fec, packet *pkt, const uint8_t *data) {
+   int len = ntohs(pkt->length);
+   int head = pkt->unused & EXT_STREAM ? STREAM_FRAME_LEN : 0;
+   if (data == NULL) data = pkt->payload + head;
+   if (fec->count == 0) {
+      fec->first_seq = ntohl(pkt->seq);
+      fec->region = 0;
+      for (int j = 0; j < fec->k; j++) {
+         // The last group's parity may still be queued
+         fec->parity[j] = pool_unshare(fec->pool, fec->parity[j]);
+         memset(fec->parity[j]->payload, 0, fec->max_payload);
+      }
+   }
+   int i = fec->count++;
+   fec->lengths[i] = len | (pkt->unused & EXT_COMP ? 0x8000 : 0) | (head > 0 ? 0x4000 : 0);
+   if (len > fec->region) fec->region = len;
+   int table = 4 + 2 * fec->n;
+   for (int j = 0; j < fec->k; j++) {
+      gf_mul_add(fec->parity[j]->payload + table, pkt->payload, fec_coef[j][i], head);
+      gf_mul_add(fec->parity[j]->payload + table + head, data, fec_coef[j][i], len - head);
+   }
+   return fec->count == fec->n;
+}
+
+// Queues the parity packets for the current group, however full it is, and starts a new one.
+// Returns the number of parity packets sent.
+int fec_flush(fec_encoder *fec, io_layer *io, struct sockaddr_in *addr) {
+   int n = fec->count;
+   if (n == 0) return 0;
+   for (int j = 0; j < fec->k; j++) {
+      packet *p = fec->parity[j];
+      // The coded payloads sit after a table sized for a full group
+      if (n < fec->n) memmove(p->payload + 4 + 2 * n, p->payload + 4 + 2 * fec->n, fec->region);
+      p->payload[0] = n;
+      p->payload[1] = fec->k;
+      p->payload[2] = j;
+      p->payload[3] = 0;
+      for (int i = 0; i < n; i++) {
+         p->payload[4 + 2 * i] = fec->lengths[i] >> 8;
+         p->payload[5 + 2 * i] = fec->lengths[i] & 0xff;
+      }
+      int len = 4 + 2 * n + fec->region;
+      p->seq = htonl(fec->first_seq);
+      p->ack = htonl(0);
+      p->length = htons(len);
+      p->flags = 0;
+      p->unused = EXT_FEC | (fec->csum ? EXT_CSUM : 0);
+      io_queue_ref(io, p, HEADER_LEN + len, addr);
+      TRACE("Sent parity %u for %u packets from SEQ=%u.", j, n, fec->first_seq);
+   }
+   fec->count = 0;
+   fec->deadline = 0;
+   return fec->k;
+}
+
+// Remembers a data or parity packet that arrived, in case a later parity packet needs it
+void fec_cache_add(recv_window *rw, packet *pkt) {
+   pool_put(rw->fec_cache[rw->fec_cache_next]);
+   rw->fec_cache[rw->fec_cache_next] = pool_hold(rw->pool, pkt, HEADER_LEN + ntohs(pkt->length));
+   rw->fec_cache_next = (rw->fec_cache_next + 1) % FEC_CACHE_SIZE;
+}
+
+// Returns the cached data packet with this seq num and length, or the cached parity packet j of the group
+// starting at seq when parity is true; NULL if there is none
+packet *fec_cache_find(recv_window *rw, uint32_t seq, int len, bool parity, int j) {
+   for (int i = 0; i < FEC_CACHE_SIZE; i++) {
+      packet *p = rw->fec_cache[i];
+      if (p == NULL || ntohl(p->seq) != seq || ((p->unused & EXT_FEC) != 0) != parity) continue;
+      if (parity ? p->payload[2] == j : ntohs(p->length) == len) return p;
+   }
+   return NULL;
+}
+
+// Handles a parity packet: rebuilds the packets of its group that haven't arrived and are still needed, once
+// enough of the group's parity is in. Returns the number of packets rebuilt, each in a new pool buffer.
+int fec_recover(recv_window *rw, packet *pkt, int pkt_len, uint32_t exp_seq, packet *rebuilt[FEC_MAX_PARITY]) {
+   int len = ntohs(pkt->length);
+   int n = pkt->payload[0], k = pkt->payload[1];
+   int table = 4 + 2 * n;
+   if (rw->fec_cache == NULL || pkt_len < HEADER_LEN + len || len > rw->max_payload || n < 1 || n > FEC_MAX_GROUP || k < 1 ||
+       k > FEC_MAX_PARITY || pkt->payload[2] >= k || len < table) {
+      return 0;
+   }
+   fec_cache_add(rw, pkt);
+   int region = len - table;
+   uint32_t seqs[FEC_MAX_GROUP];
+   int lens[FEC_MAX_GROUP];
+   packet *have[FEC_MAX_GROUP];
+   int missing[FEC_MAX_PARITY];
+   int m = 0;
+   uint32_t seq = ntohl(pkt->seq);
+   for (int i = 0; i < n; i++) {
+      seqs[i] = seq;
+      lens[i] = (pkt->payload[4 + 2 * i] << 8 | pkt->payload[5 + 2 * i]) & 0x3fff;
+      if (lens[i] > region || lens[i] == 0) return 0;
+      seq += lens[i];
+      have[i] = fec_cache_find(rw, seqs[i], lens[i], false, 0);
+      if (have[i] != NULL) continue;
+      // Delivered but no longer cached: can't be used to rebuild the others
+      if ((int32_t)(seqs[i] + lens[i] - exp_seq) <= 0) return 0;
+      if (m == k) return 0; // More losses than parity can repair
+      missing[m++] = i;
+   }
+   if (m == 0) return 0;
+   // Use the first m parity packets of the group that have arrived
+   packet *parity[FEC_MAX_PARITY];
+   int rows[FEC_MAX_PARITY];
+   int found = 0;
+   for (int j = 0; j < k && found < m; j++) {
+      packet *p = fec_cache_find(rw, ntohl(pkt->seq), 0, true, j);
+      if (p == NULL || ntohs(p->length) != len || p->payload[0] != n) continue;
+      parity[found] = p;
+      rows[found++] = j;
+   }
+   if (found < m) return 0;
+   // Each parity minus the packets we have leaves a combination of just the missing ones; invert that
+   uint8_t syndrome[FEC_MAX_PARITY][MAX_MSS];
+   uint8_t a[FEC_MAX_PARITY][FEC_MAX_PARITY];
+   for (int r = 0; r < m; r++) {
+      memcpy(syndrome[r], parity[r]->payload + table, region);
+      for (int i = 0; i < n; i++) {
+         if (have[i] != NULL) gf_mul_add(syndrome[r], have[i]->payload, fec_coef[rows[r]][i], lens[i]);
+      }
+      for (int c = 0; c < m; c++) a[r][c] = fec_coef[rows[r]][missing[c]];
+   }
+   if (!gf_invert(a, m)) return 0;
+   for (int c = 0; c < m; c++) {
+      int i = missing[c];
+      packet *p = rebuilt[c] = pool_get(rw->pool);
+      memset(p->payload, 0, lens[i]);
+      for (int r = 0; r < m; r++) gf_mul_add(p->payload, syndrome[r], a[c][r], lens[i]);
+      p->seq = htonl(seqs[i]);
+      p->ack = htonl(0);
+      p->length = htons(lens[i]);
+      p->flags = 0;
+      p->unused = (pkt->payload[4 + 2 * i] & 0x80 ? EXT_COMP : 0) | (pkt->payload[4 + 2 * i] & 0x40 ? EXT_STREAM : 0);
+      TRACE("Rebuilt packet %u from parity.", seqs[i]);
+   }
+   rw->fec_rebuilt += m;
+   return m;
+}
+
+// Returns the number of packets the ack removed from the send window. Data reaching past edge, the right edge of
+// our receive window, is dropped without being buffered or marked received, as if it had been lost.
+int recv_packet(recv_window *rw, send_window *sw, rto_estimator *rto, output_sink *out, packet *pkt, int pkt_len, uint32_t *exp_seq,
+                uint32_t edge) {
+   int acked = 0;
+   // Process ack
+   if ((pkt->flags >> 1) & 1) {
+      uint64_t newest_sent = 0; // Most recent send time among acked packets that were never retransmitted (Karn's rule)
+      // Remove packets whose seq # < received ack; they are all at the front of the window
+      while (sw->count > 0 && (int32_t)(ntohl(send_window_pkt(sw, sw->head)->seq) - ntohl(pkt->ack)) < 0) {
+         if (!sw->retransmitted[sw->head] && sw->sent_times[sw->head] > newest_sent) newest_sent = sw->sent_times[sw->head];
+         sw->head = send_window_slot(sw, 1);
+         sw->count--;
+         acked++;
+      }
+      if (newest_sent > 0) rto_sample(rto, now_us() - newest_sent);
+      // Keep the highest SACKed seq from falling behind the ack, so serial comparisons against it stay in range
+      if ((int32_t)(sw->high_sacked - ntohl(pkt->ack)) < 0) sw->high_sacked = ntohl(pkt->ack);
+      if (pkt->unused & EXT_SACK) send_window_sack(sw, pkt, pkt_len);
+   }
+
+   if (pkt->unused & EXT_PROBE) return acked; // Path MTU probe: just padding
+   if (pkt->unused & EXT_FEC) {
+      // Parity: feed whatever it rebuilds back in as if it had arrived
+      packet *rebuilt[FEC_MAX_PARITY];
+      int n = fec_recover(rw, pkt, pkt_len, *exp_seq, rebuilt);
+      for (int i = 0; i < n; i++) {
+         // Already in a pool buffer, so buffering it just takes a reference
+         rw->pool->current = rebuilt[i];
+         recv_packet(rw, sw, rto, out, rebuilt[i], HEADER_LEN + ntohs(rebuilt[i]->length), exp_seq, edge);
+         pool_put(rebuilt[i]);
+      }
+      rw->pool->current = NULL;
+      return acked;
+   }
+
+   // Add packet to received buffer (only if there is a payload, and it fits what we negotiated)
+   if (ntohs(pkt->length) == 0 || ntohs(pkt->length) > rw->max_payload) {
+      return acked;
+   }
+   uint32_t seq = ntohl(pkt->seq);
+   // Do not add packets that are duplicates of previously received packets
+   if ((int32_t)(seq - *exp_seq) < 0) return acked;
+   uint16_t len = ntohs(pkt->length);
+   if ((int32_t)(seq + len - edge) > 0) {
+      TRACE("Past our window- dropping packet %u.", seq);
+      rw->window_drops++;
+      return acked;
+   }
+   if (rw->fec_cache != NULL) fec_cache_add(rw, pkt);
+   if (rw->num_streams > 0) {
+      // Each stream delivers in order by itself; here, as when writing by offset, just remember which ranges arrived.
+      // A packet there was no room for isn't marked, so the sender resends it.
+      if (stream_recv(rw, out, pkt)) recv_window_advance(rw, seq, seq + len, exp_seq);
+      return acked;
+   }
+   if (out->map != NULL) {
+      // Writing by offset: copy the packet into place and just remember which ranges have arrived
+      uint64_t off = sink_offset(out, seq);
+      if (off + len > out->size) return acked; // Past the end of the announced file
+      memcpy(out->map + off, pkt->payload, len);
+      recv_window_advance(rw, seq, seq + len, exp_seq);
+      sink_check_done(out, *exp_seq);
+      return acked;
+   }
+   if ((int32_t)(seq - *exp_seq) > 0) {
+      if (recv_window_add(rw, pkt)) sack_add(rw, seq, seq + len);
+      return acked;
+   }
+   // Print out the packet we were waiting for, then any buffered packets that now follow it
+   sink_deliver(out, pkt);
+   *exp_seq += ntohs(pkt->length);
+   while (rw->count > 0) {
+      int slot = recv_window_find(rw, *exp_seq);
+      if (slot < 0) break;
+      sink_deliver(out, recv_window_pkt(rw, slot));
+      *exp_seq += ntohs(recv_window_pkt(rw, slot)->length);
+      recv_window_remove(rw, slot);
+   }
+   // Buffered packets we just printed no longer need SACKing
+   int done = 0;
+   while (done < rw->num_blocks && (int32_t)(rw->blocks[done].end - *exp_seq) <= 0) done++;
+   memmove(&rw->blocks[0], &rw->blocks[done], (rw->num_blocks - done) * sizeof(sack_block));
+   rw->num_blocks -= done;
+   return acked;
+}
+
+// Congestion control: cwnd counts packets and is driven by ack and loss events from the main loop.
+// Algorithms plug in through cc_ops; fast recovery bookkeeping (NewReno style) is shared.
+typedef struct cc_state cc_state;
+typedef struct {
+   const char *name;
+   void (*init)(cc_state *cc);
+   void (*on_ack)(cc_state *cc, int acked); // acked = packets newly acked outside of recovery
+   void (*on_fast_retransmit)(cc_state *cc, int in_flight); // Third duplicate ack
+   void (*on_recovery_exit)(cc_state *cc);
+   void (*on_timeout)(cc_state *cc, int in_flight);
+} cc_ops;
+
+struct cc_state {
+   const cc_ops *ops;
+   double cwnd; // Packets we may have in flight
+   double ssthresh;
+   int max_window; // Upper bound on cwnd (--window)
+   bool in_recovery;
+   bool in_loss; // After a timeout, everything that was in flight is presumed lost
+   uint32_t recover_seq; // Recovery ends once everything below this seq num is acked
+   double prior_cwnd; // cwnd and ssthresh before the timeout, restored if it turns out to be spurious
+   double prior_ssthresh;
+};
+
+void reno_init(cc_state *cc) {
+   cc->cwnd = INITIAL_CWND < cc->max_window ? INITIAL_CWND : cc->max_window;
+   cc->ssthresh = cc->max_window;
+}
+
+void reno_on_ack(cc_state *cc, int acked) {
+   if (cc->cwnd < cc->ssthresh) {
+      cc->cwnd += acked; // Slow start: grow by one packet per packet acked
+   } else {
+      cc->cwnd += (double)acked / cc->cwnd; // Congestion avoidance: grow by one packet per RTT
+   }
+   if (cc->cwnd > cc->max_window) cc->cwnd = cc->max_window;
+}
+
+void reno_on_fast_retransmit(cc_state *cc, int in_flight) {
+   cc->ssthresh = in_flight / 2 > 2 ? in_flight / 2 : 2;
+   cc->cwnd = cc->ssthresh + 3; // The three duplicate acks mean three packets left the network
+}
+
+void reno_on_recovery_exit(cc_state *cc) {
+   cc->cwnd = cc->ssthresh;
+}
+
+void reno_on_timeout(cc_state *cc, int in_flight) {
+   cc->ssthresh = in_flight / 2 > 2 ? in_flight / 2 : 2;
+   cc->cwnd = 1;
+}
+
+const cc_ops reno_ops = {"reno", reno_init, reno_on_ack, reno_on_fast_retransmit, reno_on_recovery_exit, reno_on_timeout};
+
+// Every algorithm selectable with --cc
+const cc_ops *cc_algorithms[] = {&reno_ops, NULL};
+
+void cc_init(cc_state *cc, const cc_ops *ops, int max_window) {
+   cc->ops = ops;
+   cc->max_window = max_window;
+   cc->in_recovery = false;
+   cc->in_loss = false;
+   cc->recover_seq = 0;
+   ops->init(cc);
+}
+
+// Number of packets we may currently have in flight
+int cc_window(cc_state *cc) {
+   int window = (int)cc->cwnd;
+   if (window < 1) window = 1;
+   return window < cc->max_window ? window : cc->max_window;
+}
+
+// Called when an ack removes packets from the send window.
+// Returns 1 if it was a partial ack during fast recovery, meaning the new lowest packet was also lost.
+int cc_ack(cc_state *cc, int acked, uint32_t ack_num) {
+   if (cc->in_loss && (int32_t)(ack_num - cc->recover_seq) >= 0) cc->in_loss = false;
+   if (!cc->in_recovery) {
+      cc->ops->on_ack(cc, acked);
+      return 0;
+   }
+   if ((int32_t)(ack_num - cc->recover_seq) >= 0) {
+      cc->in_recovery = false;
+      cc->ops->on_recovery_exit(cc);
+      return 0;
+   }
+   // Deflate by what left the window, then allow one new packet (RFC 6582)
+   cc->cwnd -= acked;
+   cc->cwnd += 1;
+   if (cc->cwnd < 1) cc->cwnd = 1;
+   return 1;
+}
+
+// Called for each duplicate ack; next_seq is the seq num of the next new packet we would send.
+// Returns 1 if the lowest packet should be fast retransmitted.
+int cc_dup_ack(cc_state *cc, int num_duplicate_acks, int in_flight, uint32_t next_seq) {
+   if (cc->in_loss) return 0; // Already resending everything
+   if (cc->in_recovery) {
+      cc->cwnd += 1; // Each further duplicate ack means another packet left the network
+      return 0;
+   }
+   if (num_duplicate_acks != 3) return 0;
+   cc->in_recovery = true;
+   cc->recover_seq = next_seq;
+   cc->ops->on_fast_retransmit(cc, in_flight);
+   return 1;
+}
+
+void cc_timeout(cc_state *cc, int in_flight, uint32_t next_seq) {
+   if (!cc->in_loss) {
+      // Only the first of a run of backed off timeouts saw the window worth keeping
+      cc->prior_cwnd = cc->cwnd;
+      cc->prior_ssthresh = cc->ssthresh;
+   }
+   cc->in_recovery = false;
+   cc->in_loss = true;
+   cc->recover_seq = next_seq;
+   cc->ops->on_timeout(cc, in_flight);
+}
+
+// Called when the timeout that put us in loss recovery was spurious: ends it and restores the window
+void cc_undo(cc_state *cc) {
+   cc->in_loss = false;
+   if (cc->cwnd < cc->prior_cwnd) cc->cwnd = cc->prior_cwnd;
+   if (cc->ssthresh < cc->prior_ssthresh) cc->ssthresh = cc->prior_ssthresh;
+}
+
+// Token bucket that spreads new data packets out instead of sending a whole window back to back.
+// Tokens are kept in byte-microseconds so refilling at any rate loses no fractions.
 typedef struct {
-	uint32_t ack;
-	uint32_t seq;
-	uint16_t length;
-	uint8_t flags;
-	uint8_t unused;
-	uint8_t payload[MSS];
-} packet;
+   uint64_t rate; // Bytes per second, 0 when unpaced
+   uint64_t tokens; // Bytes we may send right now, times 1000000
+   uint64_t burst; // Bucket size in bytes
+   uint64_t last_refill;
+} pacer;
+
+void pacer_init(pacer *p) {
+   p->rate = 0;
+   p->tokens = 0;
+   p->burst = 0;
+   p->last_refill = now_us();
+}
+
+// Sets the rate; the bucket holds PACING_QUANTUM_US worth of data (at least two packets of pkt_len) so
+// fast transfers still go out in batches
+void pacer_set_rate(pacer *p, uint64_t rate, int pkt_len) {
+   uint64_t burst = rate * PACING_QUANTUM_US / 1000000;
+   if (burst < 2 * (uint64_t)pkt_len) burst = 2 * (uint64_t)pkt_len;
+   if (p->rate == 0 && rate > 0) p->tokens = burst * 1000000; // Start with a full bucket
+   p->rate = rate;
+   p->burst = burst;
+}
+
+// Returns 0 if len bytes may go out now, otherwise how many microseconds until they may
+uint64_t pacer_delay(pacer *p, int len) {
+   if (p->rate == 0) return 0;
+   uint64_t now = now_us();
+   p->tokens += (now - p->last_refill) * p->rate;
+   if (p->tokens > p->burst * 1000000) p->tokens = p->burst * 1000000;
+   p->last_refill = now;
+   uint64_t need = (uint64_t)len * 1000000;
+   if (p->tokens >= need) return 0;
+   return (need - p->tokens + p->rate - 1) / p->rate;
+}
+
+void pacer_consume(pacer *p, int len) {
+   uint64_t used = (uint64_t)len * 1000000;
+   p->tokens = p->tokens > used ? p->tokens - used : 0;
+}
+
+typedef struct {
+   int max_window; // Max packets in flight, which also sizes both windows
+   const cc_ops *cc;
+   bool sack; // Offer selective acks during the handshake
+   bool checksum; // Offer CRC32C checksums on every datagram
+   bool batching; // Use sendmmsg/recvmmsg (and GSO/GRO when available)
+   bool io_uring; // Socket, stdin and stdout I/O through io_uring when the kernel has it
+   const char *file; // Send this file instead of stdin
+   const char *out; // Write what the peer sends here instead of stdout
+   const char *out_dir; // Server: write each client's data to its own file in this directory
+   int idle_timeout; // Server: seconds of silence before a connection is dropped
+   int workers; // Server: threads, each with its own SO_REUSEPORT socket
+   bool pin; // Server: pin worker i to CPU i
+   const char *metrics; // Serve Prometheus metrics on this unix socket
+   bool pacing; // Spread each window over the RTT
+   double rate; // Cap on the sending rate in bytes per second, 0 for none
+   int ack_freq; // Ack every this many in-order data packets
+   int delack_us; // ... or once the oldest unacked one has waited this long
+   int recv_buffer; // Bytes of received data to hold at most, advertised to the peer as our window; 0 for no flow control
+   bool compress; // Offer to compress stdin data
+   int fec_n; // Send parity for every fec_n data packets, 0 for no FEC
+   int fec_k; // ... up to this many parity packets per group
+   int max_mtu; // Largest datagram (with IP and UDP headers) to negotiate and probe for
+   const char *session; // Client: keep the server's resumption token in this file
+   bool early_data; // Server: hand out resumption tokens and take data on SYNs that carry one
+   const char *streams[MAX_STREAMS]; // Files to send as streams 1 and up, alongside stdin or the --file
+   int num_streams;
+} options;
+
+void print_usage(const char *prog) {
+   fprintf(stderr, "Options for %s:\n", prog);
+   fprintf(stderr, "  --window N   max packets in flight (default %d, max %d)\n", DEFAULT_WINDOW_SIZE, MAX_WINDOW_SIZE);
+   fprintf(stderr, "  --cc NAME    congestion control algorithm:");
+   for (int i = 0; cc_algorithms[i] != NULL; i++) fprintf(stderr, " %s", cc_algorithms[i]->name);
+   fprintf(stderr, " (default %s)\n", cc_algorithms[0]->name);
+   fprintf(stderr, "  --no-sack    don't negotiate selective acks\n");
+   fprintf(stderr, "  --no-checksum       don't negotiate CRC32C checksums on every datagram\n");
+   fprintf(stderr, "  --no-batch   one send/recv syscall per datagram instead of sendmmsg/recvmmsg\n");
+   fprintf(stderr, "  --io-uring   socket, stdin and stdout I/O through io_uring (falls back if the kernel lacks it)\n");
+   fprintf(stderr, "  --file PATH  send PATH (memory mapped) instead of stdin\n");
+   fprintf(stderr, "  --out PATH   write received data to PATH instead of stdout\n");
+   fprintf(stderr, "  --out-dir DIR       server: write each client's data to DIR/IP-PORT\n");
+   fprintf(stderr, "  --idle-timeout SEC  server: drop connections silent this long (default %d)\n", DEFAULT_IDLE_TIMEOUT);
+   fprintf(stderr, "  --workers N         server: worker threads sharing the port (default 1)\n");
+   fprintf(stderr, "  --pin               server: pin each worker to its own CPU\n");
+   fprintf(stderr, "  --no-pacing         send each window back to back instead of spreading it over the RTT\n");
+   fprintf(stderr, "  --rate MBPS         cap the sending rate (megabits per second)\n");
+   fprintf(stderr, "  --compress          compress data read from stdin if the peer also asks for it\n");
+   fprintf(stderr, "  --fec N[,K]         send up to K (default 1) parity packets per N data packets if the peer also asks\n");
+   fprintf(stderr, "                      for FEC; K adapts to the loss rate (N at most %d, K at most %d)\n", FEC_MAX_GROUP, FEC_MAX_PARITY);
+   fprintf(stderr, "  --max-mtu BYTES     largest MTU to negotiate and probe the path for (default %d, %d to %d)\n", DEFAULT_MAX_MTU,
+           MSS + DATAGRAM_OVERHEAD, MAX_MSS + DATAGRAM_OVERHEAD);
+   fprintf(stderr, "  --stream PATH       also send file PATH as a stream of its own (repeatable, up to %d); the peer\n", MAX_STREAMS);
+   fprintf(stderr, "                      writes stream N next to its output as OUT.N (stream.N for stdout)\n");
+   fprintf(stderr, "  --session PATH      client: save the server's resumption token in PATH, and send data on the SYN\n");
+   fprintf(stderr, "                      when PATH holds one from an earlier connection\n");
+   fprintf(stderr, "  --no-early-data     server: don't hand out resumption tokens or take data on SYNs\n");
+   fprintf(stderr, "  --ack-freq N        ack every N in-order data packets (default %d, 1 acks each one)\n", DEFAULT_ACK_FREQ);
+   fprintf(stderr, "  --delack-ms MS      longest an ack is delayed (default %g, max %d)\n", DEFAULT_DELACK_US / 1000.0, RTO_MIN_US / 2000);
+   fprintf(stderr, "  --recv-buffer KB    received data to hold at most, out of order or waiting for the output; the peer\n");
+   fprintf(stderr, "                      never sends past it (default %d, %d to %d, 0 turns windows off but keeps the default cap)\n",
+           DEFAULT_RECV_BUFFER / 1024, MIN_RECV_BUFFER / 1024, MAX_RECV_BUFFER / 1024);
+   fprintf(stderr, "  --metrics PATH      serve Prometheus metrics on unix socket PATH (SIGUSR1 prints them)\n");
+   fprintf(stderr, "  -v, --verbose  print every trace event as it happens (SIGUSR2 dumps recent ones)\n");
+   fprintf(stderr, "  -q, --quiet    only print errors and final stats\n");
+}
+
+#define SERVER_ONLY_OPTS "diWPE" // Short codes below of options only the server takes
+#define CLIENT_ONLY_OPTS "s"
+
+// Parses --options, which may appear anywhere; positional arguments are left at argv[optind..].
+// Returns -1 if an option is invalid, including one that belongs to the other side.
+int parse_options(int argc, char *argv[], options *opts, bool server) {
+   static struct option long_opts[] = {
+      {"window", required_argument, NULL, 'w'},
+      {"cc", required_argument, NULL, 'c'},
+      {"no-sack", no_argument, NULL, 'S'},
+      {"no-checksum", no_argument, NULL, 'K'},
+      {"no-batch", no_argument, NULL, 'B'},
+      {"io-uring", no_argument, NULL, 'U'},
+      {"file", required_argument, NULL, 'f'},
+      {"out", required_argument, NULL, 'o'},
+      {"out-dir", required_argument, NULL, 'd'},
+      {"idle-timeout", required_argument, NULL, 'i'},
+      {"workers", required_argument, NULL, 'W'},
+      {"pin", no_argument, NULL, 'P'},
+      {"metrics", required_argument, NULL, 'm'},
+      {"no-pacing", no_argument, NULL, 'N'},
+      {"rate", required_argument, NULL, 'r'},
+      {"compress", no_argument, NULL, 'z'},
+      {"fec", required_argument, NULL, 'F'},
+      {"max-mtu", required_argument, NULL, 'M'},
+      {"stream", required_argument, NULL, 'T'},
+      {"session", required_argument, NULL, 's'},
+      {"no-early-data", no_argument, NULL, 'E'},
+      {"ack-freq", required_argument, NULL, 'a'},
+      {"delack-ms", required_argument, NULL, 'D'},
+      {"recv-buffer", required_argument, NULL, 'R'},
+      {"verbose", no_argument, NULL, 'v'},
+      {"quiet", no_argument, NULL, 'q'},
+      {"help", no_argument, NULL, 'h'},
+      {0, 0, 0, 0}
+   };
+   opts->max_window = DEFAULT_WINDOW_SIZE;
+   opts->cc = cc_algorithms[0];
+   opts->sack = true;
+   opts->checksum = true;
+   opts->batching = true;
+   opts->io_uring = false;
+   opts->file = NULL;
+   opts->out = NULL;
+   opts->out_dir = NULL;
+   opts->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+   opts->workers = 1;
+   opts->pin = false;
+   opts->metrics = NULL;
+   opts->pacing = true;
+   opts->rate = 0;
+   opts->compress = false;
+   opts->fec_n = 0;
+   opts->fec_k = 0;
+   opts->max_mtu = DEFAULT_MAX_MTU;
+   opts->num_streams = 0;
+   opts->session = NULL;
+   opts->early_data = true;
+   opts->ack_freq = DEFAULT_ACK_FREQ;
+   opts->delack_us = DEFAULT_DELACK_US;
+   opts->recv_buffer = DEFAULT_RECV_BUFFER;
+   int opt;
+   int index;
+   while ((opt = getopt_long(argc, argv, "vq", long_opts, &index)) != -1) {
+      if (strchr(server ? CLIENT_ONLY_OPTS : SERVER_ONLY_OPTS, opt) != NULL) {
+         fprintf(stderr, "--%s is a %s option.\n", long_opts[index].name, server ? "client" : "server");
+         print_usage(argv[0]);
+         return -1;
+      }
+      switch (opt) {
+         case 'w':
+            if (sscanf(optarg, "%d", &opts->max_window) < 1 || opts->max_window < 1 || opts->max_window > MAX_WINDOW_SIZE) {
+               fprintf(stderr, "Window must be between 1 and %d packets.\n", MAX_WINDOW_SIZE);
+               return -1;
+            }
+            break;
+         case 'c':
+            opts->cc = NULL;
+            for (int i = 0; cc_algorithms[i] != NULL; i++) {
+               if (strcmp(optarg, cc_algorithms[i]->name) == 0) opts->cc = cc_algorithms[i];
+            }
+            if (opts->cc == NULL) {
+               fprintf(stderr, "Unknown congestion control algorithm %s.\n", optarg);
+               return -1;
+            }
+            break;
+         case 'S':
+            opts->sack = false;
+            break;
+         case 'K':
+            opts->checksum = false;
+            break;
+         case 'B':
+            opts->batching = false;
+            break;
+         case 'U':
+            opts->io_uring = true;
+            break;
+         case 'f':
+            opts->file = optarg;
+            break;
+         case 'o':
+            opts->out = optarg;
+            break;
+         case 'd':
+            opts->out_dir = optarg;
+            break;
+         case 'i':
+            if (sscanf(optarg, "%d", &opts->idle_timeout) < 1 || opts->idle_timeout < 1) {
+               fprintf(stderr, "Idle timeout must be at least 1 second.\n");
+               return -1;
+            }
+            break;
+         case 'W':
+            if (sscanf(optarg, "%d", &opts->workers) < 1 || opts->workers < 1 || opts->workers > MAX_WORKERS) {
+               fprintf(stderr, "Workers must be between 1 and %d.\n", MAX_WORKERS);
+               return -1;
+            }
+            break;
+         case 'P':
+            opts->pin = true;
+            break;
+         case 'm':
+            opts->metrics = optarg;
+            break;
+         case 'N':
+            opts->pacing = false;
+            break;
+         case 'r':
+            if (sscanf(optarg, "%lf", &opts->rate) < 1 || opts->rate <= 0) {
+               fprintf(stderr, "Rate must be a positive number of megabits per second.\n");
+               return -1;
+            }
+            opts->rate *= 1000000 / 8;
+            break;
+         case 'z':
+            opts->compress = true;
+            break;
+         case 'F':
+            opts->fec_k = 1;
+            if (sscanf(optarg, "%d,%d", &opts->fec_n, &opts->fec_k) < 1 || opts->fec_n < 2 || opts->fec_n > FEC_MAX_GROUP ||
+                opts->fec_k < 1 || opts->fec_k > FEC_MAX_PARITY) {
+               fprintf(stderr, "FEC needs 2 to %d data packets and 1 to %d parity packets per group.\n", FEC_MAX_GROUP, FEC_MAX_PARITY);
+               return -1;
+            }
+            break;
+         case 'M':
+            if (sscanf(optarg, "%d", &opts->max_mtu) < 1 || opts->max_mtu < MSS + DATAGRAM_OVERHEAD || opts->max_mtu > MAX_MSS + DATAGRAM_OVERHEAD) {
+               fprintf(stderr, "Max MTU must be between %d and %d bytes.\n", MSS + DATAGRAM_OVERHEAD, MAX_MSS + DATAGRAM_OVERHEAD);
+               return -1;
+            }
+            break;
+         case 'T':
+            if (opts->num_streams == MAX_STREAMS) {
+               fprintf(stderr, "At most %d streams.\n", MAX_STREAMS);
+               return -1;
+            }
+            opts->streams[opts->num_streams++] = optarg;
+            break;
+         case 's':
+            opts->session = optarg;
+            break;
+         case 'E':
+            opts->early_data = false;
+            break;
+         case 'a':
+            if (sscanf(optarg, "%d", &opts->ack_freq) < 1 || opts->ack_freq < 1 || opts->ack_freq > MAX_WINDOW_SIZE) {
+               fprintf(stderr, "Ack frequency must be between 1 and %d packets.\n", MAX_WINDOW_SIZE);
+               return -1;
+            }
+            break;
+         case 'D': {
+            double ms;
+            if (sscanf(optarg, "%lf", &ms) < 1 || ms < 0 || ms > RTO_MIN_US / 2000) {
+               fprintf(stderr, "Delayed ack timeout must be between 0 and %d ms.\n", RTO_MIN_US / 2000);
+               return -1;
+            }
+            opts->delack_us = ms * 1000;
+            break;
+         }
+         case 'R':
+            if (sscanf(optarg, "%d", &opts->recv_buffer) < 1 || (opts->recv_buffer != 0 &&
+                (opts->recv_buffer < MIN_RECV_BUFFER / 1024 || opts->recv_buffer > MAX_RECV_BUFFER / 1024))) {
+               fprintf(stderr, "Receive buffer must be 0 or between %d and %d KB.\n", MIN_RECV_BUFFER / 1024, MAX_RECV_BUFFER / 1024);
+               return -1;
+            }
+            opts->recv_buffer *= 1024;
+            break;
+         case 'v':
+            verbosity = LOG_TRACE;
+            break;
+         case 'q':
+            verbosity = LOG_ERROR;
+            break;
+         default:
+            print_usage(argv[0]);
+            return -1;
+      }
+   }
+   return 0;
+}
+
+// Counters kept per connection; only the thread that owns the connection touches them, so they are plain integers
+typedef struct {
+   uint64_t packets_sent; // New data packets, not counting retransmissions
+   uint64_t bytes_sent;
+   uint64_t bytes_acked;
+   uint64_t packets_received; // Every datagram from the peer
+   uint64_t bytes_received; // Delivered in order
+   uint64_t duplicate_packets; // Data packets we had already delivered
+   uint64_t corrupt_packets; // Datagrams dropped because their checksum didn't match (or was missing)
+   uint64_t acks_sent; // Pure acks
+   uint64_t delayed_acks; // Acks sent because the delayed ack timer ran out
+   uint64_t dup_acks_received;
+   uint64_t timeouts;
+   uint64_t spurious_timeouts; // Timeouts undone because the original packet's ack came back right after
+   uint64_t fast_recoveries;
+   uint64_t timeout_retransmits; // Packets resent after the retransmission timer expired
+   uint64_t fast_retransmits; // Packets resent on duplicate acks or SACK holes
+   uint64_t max_in_flight;
+   uint64_t max_ooo;
+   uint64_t comp_raw_bytes; // Stdin data sent in compressed packets
+   uint64_t comp_bytes; // ... and what it compressed to
+   uint64_t fec_parity_sent;
+   uint64_t fec_rebuilt; // Packets rebuilt from the peer's parity
+   uint64_t pmtu_probes;
+   uint64_t copied_bytes; // Received bytes copied rather than kept by reference, or copied out of the read-ahead
+   uint64_t window_stalls; // Times we had data to send but the peer's window was closed
+   uint64_t window_probes;
+   uint64_t window_updates; // Acks sent only because our window opened up
+   uint64_t window_drops; // Data packets dropped for lying past our window
+   uint64_t max_out_queued; // Most output queued at once
+} conn_stats;
+
+// Datagram packetization layer path MTU discovery (RFC 8899, simplified). Data goes out at the largest payload
+// confirmed to get through, starting at MSS. Probes (padding the peer echoes) search between that and the
+// negotiated maximum; a size counts as too big once PMTU_MAX_PROBES probes of it go unanswered.
+typedef struct {
+   int size; // Largest payload known to get through
+   int max; // Largest payload both sides can receive
+   int high; // Smallest payload known not to get through, max + 1 if none is
+   int probe; // Payload size of the outstanding probe, 0 if there is none
+   int attempts; // Probes of that size sent so far
+   uint64_t probe_deadline; // When the outstanding probe counts as lost
+   uint64_t next_search; // When to search again once the search is done, 0 while searching
+   int timeouts; // Retransmission timeouts in a row, to notice a path that stopped carrying size
+} pmtu_search;
+
+void pmtu_init(pmtu_search *p, int max) {
+   memset(p, 0, sizeof(*p));
+   p->size = MSS;
+   p->max = max;
+   p->high = max + 1;
+}
+
+// Returns the payload size of the probe to send now, or 0 if none is due. The caller sets probe_deadline.
+int pmtu_next_probe(pmtu_search *p, uint64_t now) {
+   if (p->probe != 0) {
+      if (now < p->probe_deadline) return 0;
+      if (p->attempts < PMTU_MAX_PROBES) {
+         p->attempts++;
+         return p->probe;
+      }
+      p->high = p->probe;
+      p->probe = 0;
+   }
+   if (p->next_search != 0) {
+      if (now < p->next_search) return 0;
+      p->next_search = 0;
+      p->high = p->max + 1;
+   }
+   if (p->high - p->size <= PMTU_SEARCH_STEP) {
+      p->next_search = now + PMTU_RAISE_US;
+      return 0;
+   }
+   // Try the maximum first, so a jumbo frame path is confirmed in one round trip, then bisect
+   p->probe = p->high > p->max ? p->max : (p->size + p->high) / 2;
+   p->attempts = 1;
+   return p->probe;
+}
+
+// Called when the peer echoes a probe; returns true if the confirmed size grew
+bool pmtu_probe_acked(pmtu_search *p, int size) {
+   if (size != p->probe) return false; // Late echo of a size we already gave up on
+   p->probe = 0;
+   if (size <= p->size) return false;
+   p->size = size;
+   return true;
+}
+
+// Called on every retransmission timeout. Several in a row at a probed size look like the path stopped
+// carrying it (a black hole), so fall back to MSS and search again. Returns true if the size changed.
+bool pmtu_timeout(pmtu_search *p) {
+   if (p->size == MSS || ++p->timeouts < PMTU_BLACK_HOLE_TIMEOUTS) return false;
+   p->high = p->size;
+   p->size = MSS;
+   p->timeouts = 0;
+   p->probe = 0;
+   p->next_search = 0;
+   return true;
+}
+
+// Everything about the transfer with one peer. The server keeps one per client, the client just one.
+typedef struct connection {
+   struct sockaddr_in addr;
+   bool established; // False until the handshake completes
+   bool zero_rtt; // Server: established from a SYN with a resumption token, and the client hasn't answered our SYN-ACK yet
+   uint32_t iss; // Our initial seq num
+   uint32_t peer_iss; // The peer's initial seq num
+   uint64_t peer_file_size; // From the peer's handshake options, 0 if it is streaming
+   uint64_t syn_sent_time; // When we last sent our SYN or SYN-ACK
+   recv_window recv_win;
+   send_window send_win;
+   cc_state cc;
+   rto_estimator rto;
+   uint64_t rto_deadline; // When the retransmission timer fires (now_us() clock), 0 if it isn't armed
+   uint64_t timeout_time; // When the last timeout resent the lowest packet, 0 once an ack has followed it
+   pacer pace;
+   bool pacing; // Pace at cwnd / SRTT (on top of any rate cap)
+   uint64_t rate_cap; // Bytes per second, 0 for none
+   uint64_t pace_until; // Pacer is holding back the next packet until then, 0 if it isn't
+   uint64_t last_heard; // When we last received anything from the peer
+   uint32_t current_seq; // Seq num of the next new byte we send
+   uint32_t next_exp_seq; // Next seq num we expect from the peer
+   uint32_t most_recent_ack;
+   int num_duplicate_acks;
+   bool sack_ok; // Both sides offered SACK in the handshake
+   bool csum_ok; // Both sides offered checksums in the handshake, so every datagram after it carries one
+   bool comp_ok; // Both sides offered compression in the handshake
+   bool rwnd_ok; // Both sides offered receive windows in the handshake, so every ack carries one
+   int recv_buffer; // Our buffer budget, which our window is what is left of
+   uint32_t rwnd_edge; // Right edge of the window we last advertised (ack plus window)
+   uint32_t peer_edge; // ... and of the peer's: we send nothing past it
+   bool window_stalled; // Held back by the peer's window since the last packet we sent
+   uint64_t persist_deadline; // When to probe a closed peer window with nothing in flight, 0 if not waiting on one
+   uint64_t persist_us; // Backoff between those probes
+   uint8_t *comp_buf; // Stdin read ahead, allocated when first compressing
+   int comp_len;
+   int comp_off; // Start of what hasn't been sent yet
+   int comp_skip; // Packets to send raw before trying to compress again
+   int comp_backoff; // comp_skip after the next block that doesn't shrink
+   const uint8_t *early; // Client: stdin data our SYN carried but the server didn't take, to send again first
+   int early_len;
+   int early_off;
+   bool fec_ok; // Both sides offered FEC in the handshake
+   fec_encoder fec;
+   int seg_size; // Payload of a full data packet
+   int max_payload; // Largest payload we can receive
+   int peer_max_payload; // ... and the peer can
+   pmtu_search pmtu;
+   int probe_echo; // Size of a probe from the peer, to echo in our next pure ack
+   bool send_ack; // An ack is due: send it with the next packet, or as a pure ack if there is none
+   int ack_freq; // Ack every this many in-order data packets
+   uint64_t delack_us;
+   int unacked; // In-order data packets received since we last acked
+   uint64_t delack_deadline; // When a held back ack must go out, 0 if none is
+   input_source src;
+   input_source *streams; // Our --stream files, sent as streams 1 and up; a copy so each connection has its own offsets
+   int num_streams; // 0 unless we send stream frames
+   int next_stream; // Stream whose turn it is to send
+   bool stream_ok; // Both sides take stream frames
+   int peer_streams; // Streams the peer sends (counting stream 0), 0 if it doesn't use stream frames
+   char *out_path; // Our --out (NULL for stdout); the peer's streams 1 and up go next to it
+   bool has_input; // We send src to this peer (stdin only goes to one connection)
+   bool input_eof;
+   bool input_ready; // Cleared once a stdin read would block, set again when poll says stdin is readable
+   output_sink out;
+   conn_stats stats;
+   struct connection *next; // Next connection in the same hash bucket
+   int index; // Position in the connection table's list
+} connection;
+
+// Sets up a connection to addr that hasn't done its handshake yet. The caller fills in src and out.
+void conn_init(connection *c, options *opts, struct sockaddr_in *addr) {
+   memset(c, 0, sizeof(*c));
+   c->addr = *addr;
+   cc_init(&c->cc, opts->cc, opts->max_window);
+   rto_init(&c->rto);
+   pacer_init(&c->pace);
+   c->pacing = opts->pacing;
+   c->rate_cap = opts->rate;
+   c->ack_freq = opts->ack_freq;
+   c->delack_us = opts->delack_us;
+   c->recv_buffer = opts->recv_buffer > 0 ? opts->recv_buffer : DEFAULT_RECV_BUFFER; // Without windows it still caps the output
+   c->fec.n = opts->fec_n;
+   c->fec.max_k = c->fec.k = opts->fec_k;
+   c->seg_size = MSS;
+   c->max_payload = opts->max_mtu - DATAGRAM_OVERHEAD;
+   c->peer_max_payload = MSS;
+   c->last_heard = now_us();
+   c->input_ready = true;
+   c->out.fd = STDOUT_FILENO;
+}
+
+void conn_free(connection *c) {
+   send_window_free(&c->send_win);
+   recv_window_free(&c->recv_win);
+   sink_close(&c->out);
+   free(c->comp_buf);
+   free(c->streams);
+   free(c->out_path);
+   for (int j = 0; j < FEC_MAX_PARITY; j++) pool_put(c->fec.parity[j]);
+}
+
+// Opens the --stream files into streams; returns -1 if one can't be opened
+int streams_open(options *opts, input_source *streams) {
+   for (int i = 0; i < opts->num_streams; i++) {
+      if (source_open(&streams[i], opts->streams[i]) < 0) return -1;
+   }
+   return 0;
+}
+
+// Gives the connection its own copy of our --stream files
+void conn_set_streams(connection *c, const input_source *streams, int n) {
+   if (n == 0) return;
+   c->streams = malloc(n * sizeof(input_source));
+   if (c->streams == NULL) {
+      fprintf(stderr, "Failed to allocate streams.\n");
+      exit(1);
+   }
+   memcpy(c->streams, streams, n * sizeof(input_source));
+   c->num_streams = n;
+}
+
+// Data payload for the current path MTU, leaving room for the parity table with FEC on, the stream frame
+// with streams and the trailers a piggybacked ack may bring
+void conn_set_segment(connection *c) {
+   c->seg_size = c->pmtu.size - (c->fec_ok ? FEC_TABLE_LEN : 0) - (c->num_streams > 0 ? STREAM_FRAME_LEN : 0) -
+                 (c->rwnd_ok ? RWND_LEN : 0) - (c->csum_ok ? CSUM_LEN : 0);
+}
 
-void add_pkt_to_buff(packet buff[MAX_WINDOW_SIZE], int *buff_count, packet pkt) {
-   if (*buff_count < MAX_WINDOW_SIZE) {
-      buff[(*buff_count)++] = pkt;
+// Finishes the handshake: first_seq is the seq num of our first data byte, peer_first_seq the peer's.
+// The windows are only set up now, once both sides have said how big a payload they can take.
+void conn_establish(connection *c, io_layer *io, uint32_t first_seq, uint32_t peer_first_seq) {
+   c->current_seq = first_seq;
+   c->most_recent_ack = first_seq;
+   c->next_exp_seq = peer_first_seq;
+   c->peer_edge = first_seq + MIN_RECV_BUFFER;
+   c->rwnd_edge = peer_first_seq + MIN_RECV_BUFFER;
+   int max = c->max_payload < c->peer_max_payload ? c->max_payload : c->peer_max_payload;
+   send_window_init(&c->send_win, c->cc.max_window, max, &io->pool);
+   recv_window_init(&c->recv_win, c->cc.max_window, max, &io->pool);
+   pmtu_init(&c->pmtu, max);
+   if (c->fec_ok) {
+      // Both sides send parity and leave room for its length table in every data packet
+      c->fec.pool = &io->pool;
+      c->fec.max_payload = max;
+      c->fec.csum = c->csum_ok;
+      c->recv_win.fec_cache = calloc(FEC_CACHE_SIZE, sizeof(packet *));
+      if (c->recv_win.fec_cache == NULL) {
+         fprintf(stderr, "Failed to allocate FEC cache.\n");
+         exit(1);
+      }
+   }
+   if (c->num_streams > 0 && !c->stream_ok) {
+      LOG(LOG_INFO, "Peer doesn't take streams, only sending stream 0.\n");
+      c->num_streams = 0;
+   }
+   conn_set_segment(c);
+   if (c->peer_streams > 0) {
+      recv_window_streams(&c->recv_win, c->peer_streams, c->out_path);
    } else {
-      fprintf(stderr, "Buffer full- cannot add more packets!\n");
+      sink_map(&c->out, c->peer_file_size, peer_first_seq);
+   }
+   c->established = true;
+}
+
+// Out of order packets buffered; when writing by offset, the number of separate ranges instead
+int conn_ooo_depth(connection *c) {
+   return c->out.map != NULL ? c->recv_win.num_blocks : c->recv_win.count;
+}
+
+// Seq num of the oldest unacked byte
+uint32_t conn_snd_una(connection *c) {
+   return c->send_win.count > 0 ? ntohl(send_window_pkt(&c->send_win, c->send_win.head)->seq) : c->current_seq;
+}
+
+// True if stream s has data we can read right now: 0 is stdin or the --file, the rest our --stream files
+bool conn_stream_ready(connection *c, int s) {
+   if (s == 0) return c->has_input && c->input_ready && !c->input_eof;
+   return c->streams[s - 1].off < c->streams[s - 1].size;
+}
+
+// True while stdin or the --file, or any --stream file, still has data to send
+bool conn_has_input(connection *c) {
+   if (c->has_input && !c->input_eof) return true;
+   for (int s = 1; s <= c->num_streams; s++) {
+      if (conn_stream_ready(c, s)) return true;
    }
-   fprintf(stderr, "\tBuffer contents: ");
-   for (int i = 0 ; i < *buff_count; i++) {
-      fprintf(stderr, "%d ", ntohl(buff[i].seq));
+   return false;
+}
+
+// Picks the stream the next packet comes from, taking turns so a busy stream can't starve the others.
+// Returns -1 if none has data ready.
+int conn_next_stream(connection *c) {
+   for (int i = 0; i <= c->num_streams; i++) {
+      int s = (c->next_stream + i) % (c->num_streams + 1);
+      if (conn_stream_ready(c, s)) {
+         c->next_stream = (s + 1) % (c->num_streams + 1);
+         return s;
+      }
    }
-   fprintf(stderr, "\n");
+   return -1;
 }
 
-void recv_packet(packet recv_packets[MAX_WINDOW_SIZE], int *recv_count, packet sent_packets[MAX_WINDOW_SIZE], int *sent_count, packet pkt, uint32_t *exp_seq) {
-   // Process ack
-   if ((pkt.flags >> 1) & 1) {
-      for (int i = 0; i < *sent_count; i++) {
-         // Remove packets whose seq # < received ack
-         if (ntohl(sent_packets[i].seq) < ntohl(pkt.ack)) {
-            fprintf(stderr, "Removing packet %d\n", ntohl(sent_packets[i].seq));
-            for (int j = i; j < *sent_count-1; j++) {
-               sent_packets[j] = sent_packets[j+1];
-            }
-            (*sent_count)--;
-            i--; // so that we check the packet that replaces the removed one
+// True if the peer's window has room for a full data packet
+bool conn_window_open(connection *c) {
+   return !c->rwnd_ok || (int32_t)(c->peer_edge - c->current_seq) >= c->seg_size + (c->num_streams > 0 ? STREAM_FRAME_LEN : 0);
+}
+
+// Received data waiting for the output, ours or a stream's
+int conn_output_queued(connection *c) {
+   int queued = sink_queued(&c->out);
+   for (int i = 1; i < c->recv_win.num_streams; i++) queued += sink_queued(&c->recv_win.stream_out[i - 1]);
+   return queued;
+}
+
+// True if received data was lost because an output queue couldn't grow
+bool conn_output_failed(connection *c) {
+   bool failed = c->out.failed;
+   for (int i = 1; i < c->recv_win.num_streams; i++) failed |= c->recv_win.stream_out[i - 1].failed;
+   return failed;
+}
+
+// Writes out what we have received, as far as the output takes it without waiting. Returns the bytes still
+// queued, for the main loop to poll the output for.
+int conn_write_output(connection *c) {
+   int queued = conn_output_queued(c);
+   if ((uint64_t)queued > c->stats.max_out_queued) c->stats.max_out_queued = queued;
+   if (queued == 0) return 0;
+   queued = sink_flush(&c->out);
+   for (int i = 1; i < c->recv_win.num_streams; i++) queued += sink_flush(&c->recv_win.stream_out[i - 1]);
+   return queued;
+}
+
+// Our receive window: the buffer budget less what it holds. That is output waiting to be written and, with
+// streams, packets waiting on an earlier one of their stream; other out of order packets sit inside the window.
+uint32_t conn_recv_window(connection *c) {
+   int used = conn_output_queued(c) + (c->recv_win.num_streams > 0 ? c->recv_win.held_bytes : 0);
+   return used < c->recv_buffer ? c->recv_buffer - used : 0;
+}
+
+// Our receive window for an ack going out now, remembered so a window update goes out once it opens up
+uint32_t conn_advertise(connection *c) {
+   uint32_t wnd = conn_recv_window(c);
+   c->rwnd_edge = c->next_exp_seq + wnd;
+   return wnd;
+}
+
+// True if a --stream file has data to send and there is room in the window for it, so we shouldn't sleep
+bool conn_streams_ready(connection *c) {
+   if (!c->established || c->send_win.count >= cc_window(&c->cc) || (c->pace_until != 0 && now_us() < c->pace_until) ||
+       !conn_window_open(c)) return false;
+   for (int s = 1; s <= c->num_streams; s++) {
+      if (conn_stream_ready(c, s)) return true;
+   }
+   return false;
+}
+
+// True if we have data to send and room in the window for it
+bool conn_can_send(connection *c) {
+   return c->established && c->has_input && !c->input_eof && c->send_win.count < cc_window(&c->cc) &&
+          (c->pace_until == 0 || now_us() >= c->pace_until) && conn_window_open(c);
+}
+
+// Bytes per second to pace at: a bit more than a cwnd per SRTT, limited by --rate. 0 means don't pace.
+uint64_t conn_pacing_rate(connection *c) {
+   uint64_t rate = 0;
+   if (c->pacing && c->rto.srtt > 0) {
+      double gain = c->cc.cwnd < c->cc.ssthresh ? PACING_GAIN_SLOW_START : PACING_GAIN;
+      rate = gain * cc_window(&c->cc) * (HEADER_LEN + c->seg_size) * 1000000 / c->rto.srtt;
+   }
+   if (c->rate_cap > 0 && (rate == 0 || c->rate_cap < rate)) rate = c->rate_cap;
+   return rate;
+}
+
+// Checks the checksum of a datagram from c's peer (c is NULL for a peer we don't know yet) and strips it.
+// Returns false if the datagram must be dropped: its checksum doesn't match, or it has none though we agreed on
+// checksums. A dropped data packet isn't acked, so the peer resends it. Nothing is agreed on before the first
+// SYN, so with checksums on (checksum) that must carry one too; otherwise a bit flip could turn them off.
+bool conn_verify(connection *c, packet *pkt, int *pkt_len, bool checksum) {
+   bool required = c != NULL ? c->csum_ok : checksum;
+   if (packet_verify(pkt, pkt_len) && (!required || (pkt->unused & EXT_CSUM))) return true;
+   if (c != NULL) c->stats.corrupt_packets++;
+   TRACE("Dropping corrupt packet- SEQ=%u, ACK=%u, LEN=%u.", ntohl(pkt->seq), ntohl(pkt->ack), ntohs(pkt->length));
+   return false;
+}
+
+// Handles one datagram from the peer: delivers its data, then processes its ack (fast retransmitting as needed)
+void conn_recv(connection *c, io_layer *io, packet *pkt, int pkt_len) {
+   c->last_heard = now_us();
+   uint32_t wnd;
+   bool has_wnd = packet_window(pkt, &pkt_len, &wnd);
+   TRACE("Received packet- SEQ=%u, ACK=%u, LEN=%u.", ntohl(pkt->seq), ntohl(pkt->ack), ntohs(pkt->length));
+   uint32_t exp_before = c->next_exp_seq;
+   uint32_t una_before = conn_snd_una(c);
+   bool had_ooo = conn_ooo_depth(c) > 0;
+   uint64_t copied_before = io->pool.copied_bytes;
+   // Hold the peer to the edge we last advertised. Without windows it doesn't know our budget, so the edge is
+   // where the budget runs out now: once the output has queued all of it nothing new gets in until it drains.
+   uint32_t edge = c->rwnd_ok ? c->rwnd_edge : c->next_exp_seq + conn_recv_window(c);
+   int acked = recv_packet(&c->recv_win, &c->send_win, &c->rto, &c->out, pkt, pkt_len, &c->next_exp_seq, edge);
+   c->stats.copied_bytes += io->cur_copied + io->pool.copied_bytes - copied_before;
+   io->cur_copied = 0;
+   c->stats.packets_received++;
+   c->stats.bytes_received += c->next_exp_seq - exp_before;
+   c->stats.bytes_acked += conn_snd_una(c) - una_before;
+   bool parity = pkt->unused & EXT_FEC;
+   bool probe = pkt->unused & EXT_PROBE;
+   if (ntohs(pkt->length) > 0 && !parity && !probe && (int32_t)(ntohl(pkt->seq) - exp_before) < 0) c->stats.duplicate_packets++;
+   c->stats.fec_rebuilt += c->recv_win.fec_rebuilt;
+   c->recv_win.fec_rebuilt = 0;
+   bool dropped = c->recv_win.window_drops > 0;
+   c->stats.window_drops += c->recv_win.window_drops;
+   c->recv_win.window_drops = 0;
+   if ((uint64_t)conn_ooo_depth(c) > c->stats.max_ooo) c->stats.max_ooo = conn_ooo_depth(c);
+   // Don't ack pure acks, even ones carrying SACK blocks. Ack data that arrives out of order, is a duplicate
+   // or fills a hole at once so the sender hears about it; ack in-order data every ack_freq packets.
+   // Parity only needs an ack if it rebuilt something. A path MTU probe is echoed in a pure ack right away.
+   // Data dropped for lying past our window isn't acked; the sender finds out from its timer.
+   if (probe) {
+      if (ntohs(pkt->length) > 0) {
+         c->probe_echo = pkt_len - HEADER_LEN + (pkt->unused & EXT_CSUM ? CSUM_LEN : 0); // The trailer counts toward the size
+         c->send_ack = true;
+      } else if (pmtu_probe_acked(&c->pmtu, ntohl(pkt->seq))) {
+         conn_set_segment(c);
+         LOG(LOG_INFO, "Path to %s:%d carries %d byte datagrams.\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port),
+             c->pmtu.size + DATAGRAM_OVERHEAD);
+      }
+   } else if (parity) {
+      if (c->next_exp_seq != exp_before) c->send_ack = true;
+   } else if (ntohs(pkt->length) > 0 && !dropped) {
+      if (ntohl(pkt->seq) != exp_before || had_ooo || ++c->unacked >= c->ack_freq) {
+         c->send_ack = true;
+      } else if (c->delack_deadline == 0) {
+         c->delack_deadline = c->last_heard + c->delack_us;
+      }
+   }
+   if (!((pkt->flags >> 1) & 1)) return;
+   int fast_retransmit = 0;
+   int new_episode = 0;
+   if (acked > 0) {
+      // Restart retransmission timeout only when new data is acked (RFC 6298 5.3)
+      c->rto_deadline = c->send_win.count > 0 ? c->last_heard + c->rto.rto : 0;
+      c->num_duplicate_acks = 0;
+      c->pmtu.timeouts = 0;
+      c->most_recent_ack = ntohl(pkt->ack);
+      if (c->timeout_time != 0) {
+         // An ack within half the min RTT of the resend can't be for it, so the original got through and the
+         // timeout was spurious (Eifel style detection, with the clock instead of timestamps). Undo the cut
+         // rather than resending the rest of the window.
+         if (c->cc.in_loss && c->last_heard - c->timeout_time < c->rto.min_rtt / 2) {
+            cc_undo(&c->cc);
+            c->stats.spurious_timeouts++;
+            TRACE("Timeout was spurious, restored cwnd %d.", cc_window(&c->cc));
+         }
+         c->timeout_time = 0;
+      }
+      fast_retransmit = cc_ack(&c->cc, acked, c->most_recent_ack);
+   } else if (ntohl(pkt->ack) == c->most_recent_ack && c->send_win.count > 0) {
+      // Check for duplicate acks
+      c->num_duplicate_acks++;
+      c->stats.dup_acks_received++;
+      fast_retransmit = new_episode = cc_dup_ack(&c->cc, c->num_duplicate_acks, c->send_win.count, c->current_seq);
+      // During recovery every SACK can reveal more holes
+      if (c->cc.in_recovery && c->sack_ok) fast_retransmit = 1;
+   } else {
+      c->most_recent_ack = ntohl(pkt->ack);
+   }
+   // The window of an ack that arrived out of order, behind one we already had, is stale
+   if (has_wnd && (int32_t)(ntohl(pkt->ack) - conn_snd_una(c)) >= 0) c->peer_edge = ntohl(pkt->ack) + wnd;
+   if (fast_retransmit) {
+      if (new_episode) {
+         c->send_win.episode++;
+         c->stats.fast_recoveries++;
+      }
+      c->stats.fast_retransmits += retransmit_holes(&c->send_win, io, &c->addr, cc_window(&c->cc));
+   }
+   // After a timeout, each ack makes room to resend more of what was in flight
+   if (c->cc.in_loss && acked > 0) {
+      c->stats.timeout_retransmits += retransmit_lost(&c->send_win, io, &c->addr, cc_window(&c->cc), c->cc.recover_seq);
+   }
+}
+
+// Earliest time the connection needs attention (retransmission timer, delayed ack or pacer), 0 if none
+uint64_t conn_deadline(connection *c) {
+   uint64_t deadline = c->rto_deadline;
+   if (c->delack_deadline != 0 && (deadline == 0 || c->delack_deadline < deadline)) deadline = c->delack_deadline;
+   if (c->pace_until != 0 && (deadline == 0 || c->pace_until < deadline)) deadline = c->pace_until;
+   if (c->fec.deadline != 0 && (deadline == 0 || c->fec.deadline < deadline)) deadline = c->fec.deadline;
+   // A probe only matters while there is data to send; conn_send() deals with its deadline once there is again
+   if (c->pmtu.probe != 0 && conn_has_input(c) && (deadline == 0 || c->pmtu.probe_deadline < deadline)) deadline = c->pmtu.probe_deadline;
+   if (c->persist_deadline != 0 && (deadline == 0 || c->persist_deadline < deadline)) deadline = c->persist_deadline;
+   return deadline;
+}
+
+// Reads stdin into the next packet's payload, compressing it if the peer agreed to that and it shrinks.
+// Returns the payload length, 0 at the end of input or -1 if stdin would block; *compressed says which.
+int conn_read(connection *c, uint8_t *payload, bool *compressed) {
+   *compressed = false;
+   if (c->early_off < c->early_len) {
+      int len = c->early_len - c->early_off < c->seg_size ? c->early_len - c->early_off : c->seg_size;
+      memcpy(payload, c->early + c->early_off, len);
+      c->stats.copied_bytes += len;
+      c->early_off += len;
+      return len;
+   }
+   if (!c->comp_ok) return source_read(&c->src, payload, c->seg_size);
+   if (c->comp_buf == NULL && (c->comp_buf = malloc(COMP_BUF_SIZE)) == NULL) return source_read(&c->src, payload, c->seg_size);
+   // Top up the read ahead so a packet can cover as much input as it compresses
+   if (c->comp_len - c->comp_off < COMP_MAX_INPUT) {
+      memmove(c->comp_buf, c->comp_buf + c->comp_off, c->comp_len - c->comp_off);
+      c->comp_len -= c->comp_off;
+      c->comp_off = 0;
+      while (c->comp_len < COMP_BUF_SIZE) {
+         int bytes_read = source_read(&c->src, c->comp_buf + c->comp_len, COMP_BUF_SIZE - c->comp_len);
+         if (bytes_read <= 0) {
+            if (c->comp_len == 0) return bytes_read;
+            break;
          }
+         c->comp_len += bytes_read;
+      }
+   }
+   const uint8_t *in = c->comp_buf + c->comp_off;
+   int avail = c->comp_len - c->comp_off;
+   if (c->comp_skip > 0) {
+      c->comp_skip--;
+   } else {
+      int consumed;
+      int len = lz_compress(in, avail < COMP_MAX_INPUT ? avail : COMP_MAX_INPUT, payload, c->seg_size, &consumed);
+      if (len < consumed) {
+         c->comp_backoff = 0;
+         c->comp_off += consumed;
+         c->stats.comp_raw_bytes += consumed;
+         c->stats.comp_bytes += len;
+         *compressed = true;
+         return len;
       }
+      // Didn't shrink: send raw, and back off exponentially before trying again so incompressible input
+      // costs little
+      c->comp_backoff = c->comp_backoff == 0 ? 1 : (c->comp_backoff * 2 < COMP_MAX_SKIP ? c->comp_backoff * 2 : COMP_MAX_SKIP);
+      c->comp_skip = c->comp_backoff;
    }
+   int len = avail < c->seg_size ? avail : c->seg_size;
+   memcpy(payload, in, len);
+   c->stats.copied_bytes += len;
+   c->comp_off += len;
+   return len;
+}
+
+// Sends the current FEC group's parity, then picks how many parity packets the next group gets: one more
+// if anything had to be retransmitted since the last group (FEC isn't keeping up with the loss rate), one
+// fewer after FEC_ADAPT_GROUPS groups in a row without retransmissions
+void conn_fec_flush(connection *c, io_layer *io) {
+   int sent = fec_flush(&c->fec, io, &c->addr);
+   if (sent == 0) return;
+   c->stats.fec_parity_sent += sent;
+   pacer_consume(&c->pace, sent * (HEADER_LEN + c->seg_size));
+   uint64_t retransmits = c->stats.timeout_retransmits + c->stats.fast_retransmits;
+   if (retransmits > c->fec.retransmits) {
+      if (c->fec.k < c->fec.max_k) c->fec.k++;
+      c->fec.clean_groups = 0;
+   } else if (++c->fec.clean_groups >= FEC_ADAPT_GROUPS) {
+      if (c->fec.k > 1) c->fec.k--;
+      c->fec.clean_groups = 0;
+   }
+   c->fec.retransmits = retransmits;
+}
 
-   // Add packet to received buffer (only if there is a payload)
-   if (ntohs(pkt.length) == 0) {
+// Marks an ack as sent, whether pure or piggybacked
+void conn_acked(connection *c) {
+   c->send_ack = false;
+   c->unacked = 0;
+   c->delack_deadline = 0;
+}
+
+// Called once the retransmission timer expires
+void conn_timeout(connection *c, io_layer *io) {
+   if (c->send_win.count == 0) {
+      c->rto_deadline = 0;
       return;
    }
-   // Do not add packets that are duplicates of previously received packets
-   if (ntohl(pkt.seq) >= *exp_seq) 
-      add_pkt_to_buff(recv_packets, recv_count, pkt); 
-   // Look for packet that matches expected seq num to print out
-   int packet_found;
-   do {
-      packet_found = 0;
-      for (int i = 0; i < *recv_count; i++) {
-         if (ntohl(recv_packets[i].seq) == *exp_seq) {
-               packet_found = 1;
-               write(1, recv_packets[i].payload, ntohs(recv_packets[i].length)); // Print out found packet
-               *exp_seq += ntohs(recv_packets[i].length);
-               // Remove packet from buffer
-               for (int j = i; j < *recv_count - 1; j++) {
-                  recv_packets[j] = recv_packets[j + 1];
-               }
-               (*recv_count)--;
-               break;  // Restart loop to check for the new expected seq num
+   TRACE("Retransmission timer expired (SRTT=%uus, RTO=%uus).", c->rto.srtt, c->rto.rto);
+   c->send_win.episode++;
+   c->stats.timeouts++;
+   // Resend only the lowest packet; the rest follow from retransmit_lost() as acks reopen cwnd in slow start
+   retransmit_slot(&c->send_win, io, &c->addr, c->send_win.head);
+   c->stats.timeout_retransmits++;
+   c->timeout_time = now_us();
+   cc_timeout(&c->cc, c->send_win.count, c->current_seq);
+   rto_backoff(&c->rto);
+   if (pmtu_timeout(&c->pmtu)) {
+      conn_set_segment(c);
+      LOG(LOG_INFO, "Repeated timeouts to %s:%d, falling back to %d byte datagrams.\n", inet_ntoa(c->addr.sin_addr),
+          ntohs(c->addr.sin_port), MSS + DATAGRAM_OVERHEAD);
+   }
+   c->rto_deadline = now_us() + c->rto.rto;
+}
+
+// Sends a path MTU probe: size bytes of padding that the peer echoes in a pure ack. Probes take no
+// sequence space and aren't retransmitted; pmtu_next_probe() decides when to send another.
+void conn_send_probe(connection *c, io_layer *io, int size) {
+   static const uint8_t padding[MAX_MSS];
+   int len = size - (c->csum_ok ? CSUM_LEN : 0); // The checksum trailer makes up the rest
+   packet probe = {
+      .ack = htonl(0),
+      .seq = htonl(size),
+      .length = htons(len),
+      .flags = 0,
+      .unused = EXT_PROBE | (c->csum_ok ? EXT_CSUM : 0)
+   };
+   io_queue(io, &probe, HEADER_LEN + len, padding, &c->addr);
+   TRACE("Sent path MTU probe of %d bytes.", HEADER_LEN + size);
+   c->pmtu.probe_deadline = now_us() + c->rto.rto;
+   c->stats.pmtu_probes++;
+}
+
+// Sends a window probe: a byte of padding the peer echoes like a path MTU probe, in a pure ack that carries its
+// window. Sent while the peer's window is closed and nothing is in flight, in case its window update was lost.
+void conn_send_window_probe(connection *c, io_layer *io) {
+   static const uint8_t padding[1];
+   packet probe = {
+      .ack = htonl(0),
+      .seq = htonl(sizeof(padding)),
+      .length = htons(sizeof(padding)),
+      .flags = 0,
+      .unused = EXT_PROBE | (c->csum_ok ? EXT_CSUM : 0)
+   };
+   io_queue(io, &probe, HEADER_LEN + sizeof(padding), padding, &c->addr);
+   TRACE("Sent window probe (peer window %d bytes).", (int32_t)(c->peer_edge - c->current_seq));
+   c->stats.window_probes++;
+}
+
+// Sends new data until the window is full or the input runs dry, piggybacking any pending ack (even a delayed
+// one, since it costs nothing) on the first packet. If an ack is due and that wasn't possible it goes out as a
+// pure ack (carrying SACK blocks when negotiated). Every ack carries our receive window once that is negotiated,
+// and the peer's window limits what we send.
+void conn_send(connection *c, io_layer *io) {
+   c->pace_until = 0;
+   if (c->delack_deadline != 0 && now_us() >= c->delack_deadline) {
+      c->send_ack = true;
+      c->stats.delayed_acks++;
+   }
+   // Once the output drains and our window opens up by a good part of the budget, say so: the peer may be
+   // waiting on it with nothing in flight
+   if (c->established && c->rwnd_ok && !c->send_ack && (int32_t)(c->next_exp_seq + conn_recv_window(c) - c->rwnd_edge) >= c->recv_buffer / 4) {
+      TRACE("Window update- window %u bytes.", conn_recv_window(c));
+      c->send_ack = true;
+      c->stats.window_updates++;
+   }
+   if (c->established && conn_has_input(c)) pacer_set_rate(&c->pace, conn_pacing_rate(c), HEADER_LEN + c->seg_size);
+   // Don't hold a partial FEC group back for long: its parity is what repairs a loss without a round trip
+   if (c->fec.deadline != 0 && now_us() >= c->fec.deadline) conn_fec_flush(c, io);
+   // Only probe while there is data to send, since that is what a bigger size is for
+   if (c->established && conn_has_input(c)) {
+      int probe = pmtu_next_probe(&c->pmtu, now_us());
+      if (probe > 0) conn_send_probe(c, io, probe);
+   }
+   while (c->established) {
+      packet *out_pkt = c->send_win.count < cc_window(&c->cc) ? send_window_next(&c->send_win) : NULL;
+      if (out_pkt == NULL) break;
+      if (!conn_window_open(c)) {
+         if (!c->window_stalled && conn_has_input(c)) {
+            TRACE("Peer window closed- %d bytes left.", (int32_t)(c->peer_edge - c->current_seq));
+            c->window_stalled = true;
+            c->stats.window_stalls++;
+         }
+         break;
+      }
+      int s = conn_next_stream(c);
+      if (s < 0) break;
+      // Assume a full packet; the last one before the input runs dry just goes out a little early
+      uint64_t wait = pacer_delay(&c->pace, HEADER_LEN + c->seg_size);
+      if (wait > 0) {
+         c->pace_until = now_us() + wait;
+         c->next_stream = s; // Still its turn
+         break;
+      }
+      int head = c->num_streams > 0 ? STREAM_FRAME_LEN : 0;
+      input_source *src = s == 0 ? &c->src : &c->streams[s - 1];
+      int bytes_read;
+      bool compressed = false;
+      const uint8_t *data = NULL; // Payload, when it lives in the mapped file rather than the slot
+      if (src->file) {
+         data = source_next(src, c->seg_size, &bytes_read);
+      } else {
+         // Read straight into the send buffer slot so the data is never copied (unless compressing)
+         bytes_read = conn_read(c, out_pkt->payload + head, &compressed);
+         if (bytes_read > 0) src->off += bytes_read;
+      }
+      if (bytes_read <= 0) {
+         // Only stdin or the --file runs dry; a --stream file isn't picked once it is all sent
+         if (bytes_read == 0) c->input_eof = true; // Nothing more will arrive, so stop polling stdin
+         c->input_ready = false;
+         continue;
+      }
+      if (head > 0) frame_write(out_pkt, s, src->off - bytes_read);
+      int len = head + bytes_read;
+      out_pkt->seq = htonl(c->current_seq);
+      out_pkt->length = htons(len);
+      out_pkt->unused = (compressed ? EXT_COMP : 0) | (head > 0 ? EXT_STREAM : 0) | (c->csum_ok ? EXT_CSUM : 0);
+      send_window_commit(&c->send_win, data);
+      // Piggyback the ack on the sent copy only; retransmissions go out without it.
+      // While packets are buffered out of order, leave the ack for a pure ack that can carry SACK blocks.
+      bool piggyback = (c->send_ack || c->unacked > 0) && !(c->sack_ok && c->recv_win.num_blocks > 0) && c->probe_echo == 0;
+      out_pkt->ack = htonl(piggyback ? c->next_exp_seq : 0);
+      out_pkt->flags = piggyback ? 0b00000010 : 0;
+      uint32_t wnd = 0;
+      if (piggyback && c->rwnd_ok) {
+         out_pkt->unused |= EXT_RWND;
+         wnd = conn_advertise(c);
+      }
+      if (piggyback) conn_acked(c);
+      // As io_queue() or io_queue_ref() would, with the window
+      if (data != NULL) {
+         io_push(io, out_pkt, HEADER_LEN + head, len + HEADER_LEN, data, NULL, wnd, &c->addr);
+      } else {
+         io_push(io, out_pkt, HEADER_LEN, len + HEADER_LEN, out_pkt->payload, pool_ref(out_pkt), wnd, &c->addr);
+      }
+      TRACE("Sent packet- SEQ=%u, ACK=%u, LEN=%u.", c->current_seq, ntohl(out_pkt->ack), len);
+      out_pkt->ack = htonl(0);
+      out_pkt->flags = 0;
+      out_pkt->unused &= ~EXT_RWND;
+      c->window_stalled = false;
+      c->current_seq += len;
+      pacer_consume(&c->pace, len + HEADER_LEN);
+      c->stats.packets_sent++;
+      c->stats.bytes_sent += len;
+      if ((uint64_t)c->send_win.count > c->stats.max_in_flight) c->stats.max_in_flight = c->send_win.count;
+      if (c->rto_deadline == 0) c->rto_deadline = now_us() + c->rto.rto;
+      if (c->fec_ok) {
+         if (c->fec.count == 0) c->fec.deadline = now_us() + (c->rto.srtt / 4 > 1000 ? c->rto.srtt / 4 : 1000);
+         if (fec_add(&c->fec, out_pkt, data)) conn_fec_flush(c, io);
+      }
+   }
+   if (c->fec.count > 0) {
+      // Flush once the input runs dry
+      bool ready = false;
+      for (int s = 0; s <= c->num_streams; s++) ready |= conn_stream_ready(c, s);
+      if (!ready) conn_fec_flush(c, io);
+   }
+   // With nothing in flight no ack comes to reopen a closed window, only the peer's window update, so probe
+   // for it in case that was lost, backing off like the retransmission timer
+   if (c->established && c->send_win.count == 0 && conn_has_input(c) && !conn_window_open(c)) {
+      uint64_t now = now_us();
+      if (c->persist_deadline == 0) {
+         c->persist_us = c->rto.rto > PERSIST_MIN_US ? c->rto.rto : PERSIST_MIN_US;
+      } else if (now >= c->persist_deadline) {
+         conn_send_window_probe(c, io);
+         c->persist_us = c->persist_us * 2 < RTO_MAX_US ? c->persist_us * 2 : RTO_MAX_US;
+      }
+      if (c->persist_deadline == 0 || now >= c->persist_deadline) c->persist_deadline = now + c->persist_us;
+   } else {
+      c->persist_deadline = 0;
+   }
+   if (c->send_ack) {
+      packet ack_pkt = {
+         .ack = htonl(c->next_exp_seq),
+         .seq = htonl(0),
+         .length = htons(0),
+         .flags = 0b00000010,
+         .unused = c->csum_ok ? EXT_CSUM : 0,
+         .payload = {0}
+      };
+      int ack_len = HEADER_LEN;
+      if (c->sack_ok) ack_len += recv_window_write_sack(&c->recv_win, &ack_pkt);
+      if (c->probe_echo > 0) {
+         ack_pkt.unused |= EXT_PROBE;
+         ack_pkt.seq = htonl(c->probe_echo);
+         c->probe_echo = 0;
+      }
+      if (c->rwnd_ok) ack_pkt.unused |= EXT_RWND;
+      io_push(io, &ack_pkt, ack_len, ack_len, NULL, NULL, c->rwnd_ok ? conn_advertise(c) : 0, &c->addr);
+      TRACE("Sent ACK=%u.", c->next_exp_seq);
+      c->stats.acks_sent++;
+      conn_acked(c);
+   }
+}
+
+// Metrics exported with --metrics, one value per connection each
+enum {
+   M_PACKETS_SENT, M_BYTES_SENT, M_BYTES_ACKED, M_PACKETS_RECEIVED, M_BYTES_RECEIVED, M_DUPLICATE_PACKETS, M_CORRUPT_PACKETS,
+   M_ACKS_SENT, M_DELAYED_ACKS, M_DUP_ACKS_RECEIVED, M_TIMEOUTS, M_SPURIOUS_TIMEOUTS, M_FAST_RECOVERIES, M_TIMEOUT_RETRANSMITS, M_FAST_RETRANSMITS,
+   M_COMP_RAW_BYTES, M_COMP_BYTES, M_FEC_PARITY_SENT, M_FEC_REBUILT, M_IN_FLIGHT, M_MAX_IN_FLIGHT, M_CWND, M_SSTHRESH, M_OOO_PACKETS, M_MAX_OOO_PACKETS,
+   M_SEGMENT_SIZE, M_PMTU_PROBES, M_COPIED_BYTES, M_PEER_WINDOW, M_RECV_WINDOW, M_OUTPUT_QUEUED, M_WINDOW_STALLS, M_WINDOW_PROBES,
+   M_WINDOW_UPDATES, M_WINDOW_DROPS, M_SRTT, M_RTTVAR, M_MIN_RTT, M_RTO,
+   NUM_METRICS
+};
+
+typedef struct {
+   const char *name;
+   const char *type;
+   const char *help;
+} metric_def;
+
+const metric_def metric_defs[NUM_METRICS] = {
+   [M_PACKETS_SENT] = {"rudp_packets_sent_total", "counter", "New data packets sent"},
+   [M_BYTES_SENT] = {"rudp_bytes_sent_total", "counter", "New payload bytes sent"},
+   [M_BYTES_ACKED] = {"rudp_bytes_acked_total", "counter", "Payload bytes cumulatively acked by the peer"},
+   [M_PACKETS_RECEIVED] = {"rudp_packets_received_total", "counter", "Datagrams received from the peer"},
+   [M_BYTES_RECEIVED] = {"rudp_bytes_received_total", "counter", "Payload bytes delivered in order"},
+   [M_DUPLICATE_PACKETS] = {"rudp_duplicate_packets_total", "counter", "Data packets received that were already delivered"},
+   [M_CORRUPT_PACKETS] = {"rudp_corrupt_packets_total", "counter", "Datagrams dropped because their checksum didn't match"},
+   [M_ACKS_SENT] = {"rudp_acks_sent_total", "counter", "Pure acks sent"},
+   [M_DELAYED_ACKS] = {"rudp_delayed_acks_total", "counter", "Acks sent when the delayed ack timer ran out"},
+   [M_DUP_ACKS_RECEIVED] = {"rudp_dup_acks_received_total", "counter", "Duplicate acks received"},
+   [M_TIMEOUTS] = {"rudp_timeouts_total", "counter", "Retransmission timer expiries"},
+   [M_SPURIOUS_TIMEOUTS] = {"rudp_spurious_timeouts_total", "counter", "Timeouts undone because the original packet had been acked"},
+   [M_FAST_RECOVERIES] = {"rudp_fast_recoveries_total", "counter", "Fast recovery episodes entered on duplicate acks"},
+   [M_TIMEOUT_RETRANSMITS] = {"rudp_timeout_retransmits_total", "counter", "Packets resent because of a timeout"},
+   [M_FAST_RETRANSMITS] = {"rudp_fast_retransmits_total", "counter", "Packets resent because of duplicate acks or SACK holes"},
+   [M_COMP_RAW_BYTES] = {"rudp_compressed_input_bytes_total", "counter", "Input bytes sent compressed"},
+   [M_COMP_BYTES] = {"rudp_compressed_output_bytes_total", "counter", "What the compressed input bytes compressed to"},
+   [M_FEC_PARITY_SENT] = {"rudp_fec_parity_sent_total", "counter", "FEC parity packets sent"},
+   [M_FEC_REBUILT] = {"rudp_fec_rebuilt_total", "counter", "Lost packets rebuilt from the peer's parity"},
+   [M_IN_FLIGHT] = {"rudp_in_flight_packets", "gauge", "Unacked packets in the send window"},
+   [M_MAX_IN_FLIGHT] = {"rudp_max_in_flight_packets", "gauge", "Most unacked packets seen in the send window"},
+   [M_CWND] = {"rudp_cwnd_packets", "gauge", "Congestion window"},
+   [M_SSTHRESH] = {"rudp_ssthresh_packets", "gauge", "Slow start threshold"},
+   [M_OOO_PACKETS] = {"rudp_out_of_order_packets", "gauge", "Out of order packets (or ranges, when writing by offset) buffered"},
+   [M_MAX_OOO_PACKETS] = {"rudp_max_out_of_order_packets", "gauge", "Most out of order packets buffered at once"},
+   [M_SEGMENT_SIZE] = {"rudp_segment_bytes", "gauge", "Payload of a full data packet at the current path MTU"},
+   [M_PMTU_PROBES] = {"rudp_pmtu_probes_total", "counter", "Path MTU probes sent"},
+   [M_COPIED_BYTES] = {"rudp_copied_bytes_total", "counter", "Payload bytes copied between buffers instead of moved by reference"},
+   [M_PEER_WINDOW] = {"rudp_peer_window_bytes", "gauge", "Room left in the peer's receive window"},
+   [M_RECV_WINDOW] = {"rudp_recv_window_bytes", "gauge", "Our receive window: the buffer budget less what it holds"},
+   [M_OUTPUT_QUEUED] = {"rudp_output_queued_bytes", "gauge", "Received data waiting for the output"},
+   [M_WINDOW_STALLS] = {"rudp_window_stalls_total", "counter", "Times sending was held back by the peer's window"},
+   [M_WINDOW_PROBES] = {"rudp_window_probes_total", "counter", "Probes of a closed peer window"},
+   [M_WINDOW_UPDATES] = {"rudp_window_updates_total", "counter", "Acks sent because our window opened up"},
+   [M_WINDOW_DROPS] = {"rudp_window_drops_total", "counter", "Data packets dropped for lying past our window"},
+   [M_SRTT] = {"rudp_srtt_microseconds", "gauge", "Smoothed round trip time"},
+   [M_RTTVAR] = {"rudp_rttvar_microseconds", "gauge", "Round trip time variation"},
+   [M_MIN_RTT] = {"rudp_min_rtt_microseconds", "gauge", "Lowest round trip time sampled"},
+   [M_RTO] = {"rudp_rto_microseconds", "gauge", "Current retransmission timeout"},
+};
+
+// One connection's metric values, labelled with its peer
+typedef struct {
+   char peer[32];
+   uint64_t values[NUM_METRICS];
+} metric_row;
+
+// Fills in row for connection c
+void conn_metrics(connection *c, metric_row *row) {
+   snprintf(row->peer, sizeof(row->peer), "%s:%d", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port));
+   uint64_t *v = row->values;
+   v[M_PACKETS_SENT] = c->stats.packets_sent;
+   v[M_BYTES_SENT] = c->stats.bytes_sent;
+   v[M_BYTES_ACKED] = c->stats.bytes_acked;
+   v[M_PACKETS_RECEIVED] = c->stats.packets_received;
+   v[M_BYTES_RECEIVED] = c->stats.bytes_received;
+   v[M_DUPLICATE_PACKETS] = c->stats.duplicate_packets;
+   v[M_CORRUPT_PACKETS] = c->stats.corrupt_packets;
+   v[M_ACKS_SENT] = c->stats.acks_sent;
+   v[M_DELAYED_ACKS] = c->stats.delayed_acks;
+   v[M_DUP_ACKS_RECEIVED] = c->stats.dup_acks_received;
+   v[M_TIMEOUTS] = c->stats.timeouts;
+   v[M_SPURIOUS_TIMEOUTS] = c->stats.spurious_timeouts;
+   v[M_FAST_RECOVERIES] = c->stats.fast_recoveries;
+   v[M_TIMEOUT_RETRANSMITS] = c->stats.timeout_retransmits;
+   v[M_FAST_RETRANSMITS] = c->stats.fast_retransmits;
+   v[M_COMP_RAW_BYTES] = c->stats.comp_raw_bytes;
+   v[M_COMP_BYTES] = c->stats.comp_bytes;
+   v[M_FEC_PARITY_SENT] = c->stats.fec_parity_sent;
+   v[M_FEC_REBUILT] = c->stats.fec_rebuilt;
+   v[M_IN_FLIGHT] = c->send_win.count;
+   v[M_MAX_IN_FLIGHT] = c->stats.max_in_flight;
+   v[M_CWND] = cc_window(&c->cc);
+   v[M_SSTHRESH] = c->cc.ssthresh;
+   v[M_OOO_PACKETS] = conn_ooo_depth(c);
+   v[M_MAX_OOO_PACKETS] = c->stats.max_ooo;
+   v[M_SEGMENT_SIZE] = c->seg_size;
+   v[M_PMTU_PROBES] = c->stats.pmtu_probes;
+   v[M_COPIED_BYTES] = c->stats.copied_bytes;
+   v[M_PEER_WINDOW] = c->rwnd_ok && (int32_t)(c->peer_edge - c->current_seq) > 0 ? c->peer_edge - c->current_seq : 0;
+   v[M_RECV_WINDOW] = c->rwnd_ok ? conn_recv_window(c) : 0;
+   v[M_OUTPUT_QUEUED] = conn_output_queued(c);
+   v[M_WINDOW_STALLS] = c->stats.window_stalls;
+   v[M_WINDOW_PROBES] = c->stats.window_probes;
+   v[M_WINDOW_UPDATES] = c->stats.window_updates;
+   v[M_WINDOW_DROPS] = c->stats.window_drops;
+   v[M_SRTT] = c->rto.srtt;
+   v[M_RTTVAR] = c->rto.rttvar;
+   v[M_MIN_RTT] = c->rto.min_rtt;
+   v[M_RTO] = c->rto.rto;
+}
+
+// Prints a connection's counters to stderr (on SIGUSR1, when it closes, and at exit)
+void print_stats(connection *c) {
+   fprintf(stderr, "Stats: SRTT=%" PRIu64 "us RTTVAR=%" PRIu64 "us RTO=%" PRIu64 "us, retransmits: %" PRIu64 " timeout, %" PRIu64 " duplicate ack\n",
+           c->rto.srtt, c->rto.rttvar, c->rto.rto, c->stats.timeout_retransmits, c->stats.fast_retransmits);
+   fprintf(stderr, "       sent %" PRIu64 " bytes in %" PRIu64 " packets (%" PRIu64 " acked), received %" PRIu64 " bytes in %" PRIu64 " packets (%" PRIu64 " duplicate), "
+           "%" PRIu64 " acks (%" PRIu64 " delayed), %" PRIu64 " timeouts (%" PRIu64 " spurious), %" PRIu64 " fast recoveries, cwnd %d, in flight %d (max %" PRIu64 "), out of order %d (max %" PRIu64 "), "
+           "segment %d bytes (%" PRIu64 " path MTU probes), copied %" PRIu64 " bytes\n",
+           c->stats.bytes_sent, c->stats.packets_sent, c->stats.bytes_acked, c->stats.bytes_received, c->stats.packets_received,
+           c->stats.duplicate_packets, c->stats.acks_sent, c->stats.delayed_acks, c->stats.timeouts, c->stats.spurious_timeouts, c->stats.fast_recoveries, cc_window(&c->cc), c->send_win.count,
+           c->stats.max_in_flight, conn_ooo_depth(c), c->stats.max_ooo, c->seg_size, c->stats.pmtu_probes, c->stats.copied_bytes);
+   if (c->stats.comp_raw_bytes > 0) {
+      fprintf(stderr, "       compressed %" PRIu64 " bytes into %" PRIu64 " (%.1fx)\n", c->stats.comp_raw_bytes, c->stats.comp_bytes,
+              (double)c->stats.comp_raw_bytes / c->stats.comp_bytes);
+   }
+   if (c->fec_ok) {
+      fprintf(stderr, "       FEC: sent %" PRIu64 " parity packets (now %d per %d), rebuilt %" PRIu64 " lost packets\n", c->stats.fec_parity_sent,
+              c->fec.k, c->fec.n, c->stats.fec_rebuilt);
+   }
+   if (c->rwnd_ok) {
+      fprintf(stderr, "       flow control: window %u of %d bytes, output queued %d (max %" PRIu64 "), peer window %d, %" PRIu64 " stalls, "
+              "%" PRIu64 " window probes, %" PRIu64 " window updates, %" PRIu64 " dropped past our window\n", conn_recv_window(c),
+              c->recv_buffer, conn_output_queued(c), c->stats.max_out_queued, (int32_t)(c->peer_edge - c->current_seq),
+              c->stats.window_stalls, c->stats.window_probes, c->stats.window_updates, c->stats.window_drops);
+   }
+   if (c->csum_ok) {
+      fprintf(stderr, "       checksums: dropped %" PRIu64 " corrupt packets, CRC32C of data sent %08x, received %08x\n",
+              c->stats.corrupt_packets, source_digest(&c->src), c->out.digest);
+      for (int s = 1; s <= c->num_streams; s++) fprintf(stderr, "       stream %d sent CRC32C %08x\n", s, source_digest(&c->streams[s - 1]));
+      for (int s = 1; s < c->recv_win.num_streams; s++) fprintf(stderr, "       stream %d received CRC32C %08x\n", s, c->recv_win.stream_out[s - 1].digest);
+   }
+}
+
+#define MAX_SCRAPES 8 // Scrapes in progress at once; more wait in the listen backlog
+#define METRICS_POLL_FDS (MAX_SCRAPES + 1) // Poll entries metrics_poll_fds() fills in
+
+// A scrape in progress on the metrics socket: the accepted connection, then the answer left to write
+typedef struct {
+   int fd; // -1 if the slot is free
+   bool requested; // The request arrived and waits on an answer
+   char *text; // The answer, NULL until there is one
+   size_t len;
+   size_t off;
+} scrape;
+
+typedef struct {
+   int listen_fd; // -1 without --metrics
+   scrape scrapes[MAX_SCRAPES];
+} metrics_server;
+
+// Opens the unix socket metrics are served on (nothing if path is NULL); returns -1 on error
+int metrics_listen(metrics_server *ms, const char *path) {
+   ms->listen_fd = -1;
+   for (int i = 0; i < MAX_SCRAPES; i++) ms->scrapes[i] = (scrape){.fd = -1};
+   if (path == NULL) return 0;
+   int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+   struct sockaddr_un addr = {.sun_family = AF_UNIX};
+   if (fd < 0 || strlen(path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Bad metrics socket path %s.\n", path);
+      return -1;
+   }
+   strcpy(addr.sun_path, path);
+   unlink(path);
+   if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+      fprintf(stderr, "Failed to listen on %s.\n", path);
+      close(fd);
+      return -1;
+   }
+   ms->listen_fd = fd;
+   return 0;
+}
+
+void scrape_close(scrape *s) {
+   close(s->fd);
+   free(s->text);
+   *s = (scrape){.fd = -1};
+}
+
+// Fills in METRICS_POLL_FDS entries: the listening socket while a slot is free, then each scrape, which
+// waits to be readable until its request arrives and writable while its answer is being written
+void metrics_poll_fds(metrics_server *ms, struct pollfd *fds) {
+   bool slot_free = false;
+   for (int i = 0; i < MAX_SCRAPES; i++) {
+      scrape *s = &ms->scrapes[i];
+      if (s->fd < 0) slot_free = true;
+      fds[i + 1] = (struct pollfd){.fd = s->requested && s->text == NULL ? -1 : s->fd, .events = s->text != NULL ? POLLOUT : POLLIN};
+   }
+   fds[0] = (struct pollfd){.fd = slot_free ? ms->listen_fd : -1, .events = POLLIN};
+}
+
+// Writes as much of a scrape's answer as the socket takes, closing it once it is all out or the scraper is gone
+void scrape_write(scrape *s) {
+   while (s->off < s->len) {
+      ssize_t n = send(s->fd, s->text + s->off, s->len - s->off, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+      if (n <= 0) break;
+      s->off += n;
+   }
+   scrape_close(s);
+}
+
+// Handles what poll() reported for the fds from metrics_poll_fds(): takes new scrapes, reads their
+// requests and writes answers. Returns true if a request waits on metrics_answer().
+bool metrics_events(metrics_server *ms, struct pollfd *fds) {
+   if (fds[0].revents & POLLIN) {
+      for (int i = 0; i < MAX_SCRAPES; i++) {
+         if (ms->scrapes[i].fd >= 0) continue;
+         int fd = accept4(ms->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+         if (fd < 0) break;
+         ms->scrapes[i].fd = fd;
+      }
+   }
+   bool requested = false;
+   for (int i = 0; i < MAX_SCRAPES; i++) {
+      scrape *s = &ms->scrapes[i];
+      if (s->fd < 0) continue;
+      short revents = fds[i + 1].revents;
+      if (s->text != NULL && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+         scrape_write(s);
+      } else if (!s->requested && (revents & (POLLIN | POLLERR | POLLHUP))) {
+         // Whatever the request says (usually an HTTP GET), the answer is the same; read what has arrived so far
+         char request[1024];
+         ssize_t n = recv(s->fd, request, sizeof(request), MSG_DONTWAIT);
+         if (n > 0) {
+            s->requested = true;
+         } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            scrape_close(s);
          }
       }
-   } while (packet_found);
+      if (s->requested && s->text == NULL) requested = true;
+   }
+   return requested;
 }
 
-// Returns index of packet with lowest seq num; returns -1 if buffer is empty
-int get_lowest_pkt(packet sent_packets[MAX_WINDOW_SIZE], int sent_count) {
-   int idx = -1;
-   int lowest_seq = 999999999;
-   for (int i = 0; i < sent_count; i++) {
-      if (ntohl(sent_packets[i].seq) < lowest_seq) {
-         lowest_seq = ntohl(sent_packets[i].seq);
-         idx = i;
+// Answers every scrape whose request has arrived with the given rows in the Prometheus text format
+void metrics_answer(metrics_server *ms, metric_row *rows, int num_rows) {
+   char *body;
+   size_t len;
+   FILE *f = open_memstream(&body, &len);
+   if (f == NULL) return;
+   fprintf(f, "# HELP rudp_connections Open connections\n# TYPE rudp_connections gauge\nrudp_connections %d\n", num_rows);
+   for (int m = 0; m < NUM_METRICS; m++) {
+      fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", metric_defs[m].name, metric_defs[m].help, metric_defs[m].name, metric_defs[m].type);
+      for (int i = 0; i < num_rows; i++) fprintf(f, "%s{peer=\"%s\"} %" PRIu64 "\n", metric_defs[m].name, rows[i].peer, rows[i].values[m]);
+   }
+   fclose(f);
+   char header[128];
+   int header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+   for (int i = 0; i < MAX_SCRAPES; i++) {
+      scrape *s = &ms->scrapes[i];
+      if (s->fd < 0 || !s->requested || s->text != NULL) continue;
+      s->text = malloc(header_len + len);
+      if (s->text == NULL) {
+         scrape_close(s);
+         continue;
       }
+      memcpy(s->text, header, header_len);
+      memcpy(s->text + header_len, body, len);
+      s->len = header_len + len;
+      scrape_write(s);
+   }
+   free(body);
+}
+
+// Closes the metrics socket and any scrapes still in progress
+void metrics_close(metrics_server *ms, const char *path) {
+   for (int i = 0; i < MAX_SCRAPES; i++) {
+      if (ms->scrapes[i].fd >= 0) scrape_close(&ms->scrapes[i]);
+   }
+   if (ms->listen_fd >= 0) {
+      close(ms->listen_fd);
+      unlink(path);
+   }
+}
+
+// Arms timerfd for the earliest of the given deadline (now_us() clock, 0 for none)
+void set_timer_at(int timerfd, uint64_t deadline) {
+   if (deadline == 0) {
+      set_timer(timerfd, 0);
+      return;
+   }
+   uint64_t now = now_us();
+   set_timer(timerfd, deadline > now ? deadline - now : 1);
+}
+
+// Loads the resumption token saved for the server at addr; returns false if there is none
+bool session_load(const char *path, struct sockaddr_in *addr, uint8_t token[TOKEN_LEN]) {
+   FILE *f = fopen(path, "r");
+   if (f == NULL) return false;
+   char ip[64], hex[2 * TOKEN_LEN + 1];
+   int port;
+   bool found = fscanf(f, "%63s %d %24s", ip, &port, hex) == 3 && strcmp(ip, inet_ntoa(addr->sin_addr)) == 0 &&
+                port == ntohs(addr->sin_port) && strlen(hex) == 2 * TOKEN_LEN;
+   for (int i = 0; found && i < TOKEN_LEN; i++) {
+      unsigned byte;
+      found = sscanf(hex + 2 * i, "%2x", &byte) == 1;
+      token[i] = byte;
+   }
+   fclose(f);
+   return found;
+}
+
+// Saves the token the server at addr gave us, for the next connection to it
+void session_save(const char *path, struct sockaddr_in *addr, const uint8_t *token) {
+   FILE *f = fopen(path, "w");
+   if (f == NULL) {
+      fprintf(stderr, "Failed to save session to %s.\n", path);
+      return;
+   }
+   fprintf(f, "%s %d ", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+   for (int i = 0; i < TOKEN_LEN; i++) fprintf(f, "%02x", token[i]);
+   fprintf(f, "\n");
+   fclose(f);
+}
+
+// Reads up to EARLY_DATA_MAX bytes of input into buf for our SYN to carry; returns how many
+int read_early(input_source *src, uint8_t *buf) {
+   if (src->file) {
+      int len;
+      const uint8_t *data = source_next(src, EARLY_DATA_MAX, &len);
+      memcpy(buf, data, len);
+      return len;
    }
-   return idx;
+   int len = source_read(src, buf, EARLY_DATA_MAX);
+   return len > 0 ? len : 0;
+}
+
+// What stdin and stdout looked like before we made them non-blocking. They are shared with whoever started us, so
+// they are put back at exit.
+int stdin_flags = -1;
+int stdout_flags = -1;
+
+void restore_stdio(void) {
+   if (stdin_flags != -1) fcntl(STDIN_FILENO, F_SETFL, stdin_flags);
+   if (stdout_flags != -1) fcntl(STDOUT_FILENO, F_SETFL, stdout_flags);
 }
 
 int main(int argc, char *argv[]) {
+   options opts;
+   if (parse_options(argc, argv, &opts, false) < 0) return -1;
+   gf_init();
+   crc32c_init();
+   if (opts.fec_n > 0) LOG(LOG_INFO, "FEC: up to %d parity per %d packets, %s kernel\n", opts.fec_k, opts.fec_n, gf_kernel);
+   if (opts.checksum) LOG(LOG_INFO, "Checksums: CRC32C, %s kernel\n", crc_kernel);
+   char **args = argv + optind;
    // Expects hostname and port arguments
-   if (argc < 3) {
+   if (argc - optind < 2) {
       fprintf(stderr, "Expected 2 arguments, got less than 2.");
       return -1;
    }
@@ -113,181 +3930,238 @@ int main(int argc, char *argv[]) {
    // Construct server address
    struct sockaddr_in serveraddr;
    serveraddr.sin_family = AF_INET; // use IPv4
-   char *IP_ADDRESS = argv[1];
-   if (strcmp(argv[1], "localhost") == 0) {
+   char *IP_ADDRESS = args[0];
+   if (strcmp(args[0], "localhost") == 0) {
       IP_ADDRESS = "127.0.0.1";
    }
-   fprintf(stderr, "Server IP: %s\n", IP_ADDRESS);
+   LOG(LOG_INFO, "Server IP: %s\n", IP_ADDRESS);
    serveraddr.sin_addr.s_addr = inet_addr(IP_ADDRESS);
    // Set sending port
    int PORT;
-   if (sscanf(argv[2], "%d", &PORT) < 1) {
+   if (sscanf(args[1], "%d", &PORT) < 1) {
       fprintf(stderr, "Error getting port number from command line arguments.");
       PORT = 8080;
    }
-   fprintf(stderr, "Server Port: %d\n", PORT);
+   LOG(LOG_INFO, "Server Port: %d\n", PORT);
    serveraddr.sin_port = htons(PORT); // Big endian
 
+   // Data to send and where to put what we receive
+   input_source src;
+   input_source streams[MAX_STREAMS];
+   output_sink out;
+   if (source_open(&src, opts.file) < 0 || streams_open(&opts, streams) < 0 || sink_open(&out, opts.out) < 0) return -1;
+
    // Make stdin non-blocking
-   flags = fcntl(STDIN_FILENO, F_GETFL, 0);
-   if (flags == -1) {
+   stdin_flags = fcntl(STDIN_FILENO, F_GETFL, 0);
+   if (stdin_flags == -1) {
       fprintf(stderr, "Error getting stdin flags.\n");
-   }
-   flags |= O_NONBLOCK;
-   if (fcntl(STDIN_FILENO, F_SETFL, flags) == -1) {
+   } else if (fcntl(STDIN_FILENO, F_SETFL, stdin_flags | O_NONBLOCK) == -1) {
       fprintf(stderr, "Error setting stdin to non-blocking.\n");
    }
+   // ... and stdout, so a slow reader backs up into our output queue (and the window we advertise) rather than
+   // stalling the loop. io_uring writes wait in the kernel instead.
+   if (!opts.io_uring) {
+      stdout_flags = fcntl(STDOUT_FILENO, F_GETFL, 0);
+      if (stdout_flags == -1 || fcntl(STDOUT_FILENO, F_SETFL, stdout_flags | O_NONBLOCK) == -1) {
+         fprintf(stderr, "Error setting stdout to non-blocking.\n");
+      }
+   }
+   atexit(restore_stdio);
 
-   // Receiving buffer to store incoming data
-   packet recv_packets[MAX_WINDOW_SIZE];
-   int recv_count = 0;
-   uint32_t next_exp_seq = 0;
-   socklen_t serversize = sizeof(serveraddr); // Temp buffer for recvfrom API
+   // Windows, seq nums and timers for the connection with the server
+   connection conn;
+   conn_init(&conn, &opts, &serveraddr);
+   conn.src = src;
+   conn.has_input = true;
+   conn.out = out;
+   conn_set_streams(&conn, streams, opts.num_streams);
+   if (opts.out != NULL) conn.out_path = strdup(opts.out);
 
    // Retransmission
-   uint32_t most_recent_ack = 0;
-   int num_duplicate_acks = 0;
-   time_t ack_time = time(NULL);
+   int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+   if (timerfd < 0) {
+      fprintf(stderr, "Failed to create retransmission timer.\n");
+      return errno;
+   }
+
+   // Exit the main loop cleanly (and print stats) on Ctrl-C or kill
+   struct sigaction sa = {0};
+   sa.sa_handler = handle_stop;
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+   // Dump the trace ring on demand
+   struct sigaction dump_sa = {0};
+   dump_sa.sa_handler = handle_trace_dump;
+   sigaction(SIGUSR2, &dump_sa, NULL);
+   // Print stats on demand
+   struct sigaction stats_sa = {0};
+   stats_sa.sa_handler = handle_stats;
+   sigaction(SIGUSR1, &stats_sa, NULL);
+   metrics_server metrics;
+   if (metrics_listen(&metrics, opts.metrics) < 0) return -1;
 
-   // For handshake
+   // For handshake. With a token from an earlier connection to this server, our SYN carries the first
+   // of our data, which the server takes right away if the token still checks out.
    srand(time(NULL));
-   int connected = 0; 
-   uint32_t rand_seq = 0;
-
-   // Sending buffer to store sent packets and buffer for data from stdin
-   packet sent_packets[MAX_WINDOW_SIZE];
-   int sent_count = 0;
-   int bytes_read; 
-   char stdin_buf[MSS];
-   uint32_t current_seq = 0;
-
-   while(1) {
-      // Initiate three way handshake
-      if (connected == 0) {
-         rand_seq = (uint32_t)(rand()) >> 1; // ensure rand seq number is less than half of uint32_max
-         packet hs_pkt = {
-            .ack = htonl(0),
-            .seq = htonl(rand_seq),
-            .length = htons(0),
-            .flags = 0b00000001,
-            .unused = 0,
-            .payload = {0}
-         };
-         int did_send = sendto(sockfd, &hs_pkt, HEADER_LEN, 0, (struct sockaddr*) &serveraddr, sizeof(serveraddr));
-         fprintf(stderr, "Sent first handshake packet- SEQ=%d.\n", rand_seq);
-         packet rec_hs_pkt = {0};
-         time_t time_now = time(NULL);
-         while (time(NULL) - time_now < 1) {
-            int bytes_recvd = recvfrom(sockfd, &rec_hs_pkt, sizeof(rec_hs_pkt), 0, (struct sockaddr*) &serveraddr, &serversize);
-            if (bytes_recvd >= HEADER_LEN) {
-               fprintf(stderr, "Received second handshake packet- SEQ=%d, ACK=%d.\n", ntohl(rec_hs_pkt.seq), ntohl(rec_hs_pkt.ack));
-               uint32_t ack_num = ntohl(rec_hs_pkt.ack);
-               uint32_t seq = ntohl(rec_hs_pkt.seq);
-               uint16_t len = ntohs(rec_hs_pkt.length);
-               bool syn = rec_hs_pkt.flags & 1;
-               bool ack = (rec_hs_pkt.flags >> 1) & 1;
-               // Verify packet
-               if (syn && ack && ack_num == rand_seq+1) {
-                  // fprintf(stderr, "Verified second handshake packet.\n");
-                  packet hs_pkt2 = {
-                     .ack = htonl(seq+1),
-                     .seq = htonl(rand_seq+1),
-                     .length = htons(0),
-                     .flags = 0b00000010,
-                     .unused = 0,
-                     .payload = {0}
-                  };
-                  current_seq = rand_seq+1;
-                  next_exp_seq = seq+1;
-                  int did_send = sendto(sockfd, &hs_pkt2, HEADER_LEN, 0, (struct sockaddr*) &serveraddr, sizeof(serveraddr));
-                  fprintf(stderr, "Sent third handshake packet- SEQ=%d, ACK=%d.\n", rand_seq+1, seq+1);
-                  connected = 1;
-                  current_seq++;
-                  ack_time = time(NULL);
-                  break;
-               }
-            }
-         }
+   conn.iss = (uint32_t)(rand()) >> 1; // ensure rand seq number is less than half of uint32_max
+   uint8_t token[TOKEN_LEN];
+   bool resuming = opts.session != NULL && session_load(opts.session, &serveraddr, token);
+   packet syn_pkt = {
+      .ack = htonl(0),
+      .seq = htonl(conn.iss),
+      .length = htons(0),
+      .flags = 0b00000001,
+      .unused = (opts.sack ? EXT_SACK : 0) | (opts.compress ? EXT_COMP : 0) | (opts.fec_n > 0 ? EXT_FEC : 0) | EXT_STREAM |
+                (opts.checksum ? EXT_CSUM : 0) | (opts.recv_buffer > 0 ? EXT_RWND : 0),
+      .payload = {0}
+   };
+   // Early data has no stream frame, so none with streams of our own
+   int early_len = resuming && opts.num_streams == 0 ? read_early(&conn.src, syn_pkt.payload) : 0;
+   syn_pkt.length = htons(early_len);
+   int syn_len = add_file_size(&syn_pkt, HEADER_LEN + early_len, &src);
+   syn_len = add_max_payload(&syn_pkt, syn_len, conn.max_payload);
+   syn_len = add_streams(&syn_pkt, syn_len, opts.num_streams);
+   if (resuming) syn_len = add_option(&syn_pkt, syn_len, OPT_TOKEN, token, TOKEN_LEN);
+   int syn_sends = 0;
+   packet hs_pkt2; // Our third handshake packet, resent if the server repeats its SYN-ACK
+   io_layer io;
+   io_init(&io, sockfd, opts.batching, opts.io_uring, opts.max_mtu - DATAGRAM_OVERHEAD);
+
+   while(!stop_requested) {
+      if (trace_dump_requested) {
+         trace_dump_requested = 0;
+         trace_dump();
+      }
+      if (stats_requested) {
+         stats_requested = 0;
+         print_stats(&conn);
+      }
+      // Send our SYN, and keep resending it (with the same seq num and data) until the server answers
+      if (!conn.established && (syn_sends == 0 || now_us() - conn.syn_sent_time >= conn.rto.rto)) {
+         if (syn_sends++ > 0) rto_backoff(&conn.rto);
+         io_queue(&io, &syn_pkt, syn_len, NULL, &conn.addr);
+         io_flush(&io);
+         conn.syn_sent_time = now_us();
+         set_timer(timerfd, conn.rto.rto);
+         LOG(LOG_INFO, "Sent first handshake packet- SEQ=%u, %d bytes of early data.\n", conn.iss, early_len);
+      }
+      // Sleep until a datagram arrives, stdin has data we have room to send, the timer fires, an output write
+      // finishes, the output takes more or a metrics scrape needs attention
+      struct pollfd fds[5 + METRICS_POLL_FDS] = {
+         {.fd = sockfd, .events = POLLIN},
+         {.fd = (!src.file && conn_can_send(&conn)) ? STDIN_FILENO : -1, .events = POLLIN},
+         {.fd = timerfd, .events = POLLIN},
+         {.fd = io_ring_fd(&io), .events = POLLIN},
+         {.fd = io_ring_fd(&io) < 0 && conn_output_queued(&conn) > 0 ? conn.out.fd : -1, .events = POLLOUT}
+      };
+      metrics_poll_fds(&metrics, &fds[5]);
+      // Don't sleep while there is file data we have room to send
+      int timeout = ((src.file && conn_can_send(&conn)) || conn_streams_ready(&conn)) ? 0 : -1;
+      if (poll(fds, 5 + METRICS_POLL_FDS, timeout) < 0) {
+         if (errno == EINTR) continue;
+         fprintf(stderr, "Error polling for events.\n");
+         trace_dump();
+         break;
+      }
+      if (fds[2].revents & POLLIN) {
+         uint64_t expirations;
+         read(timerfd, &expirations, sizeof(expirations));
       }
-      if (connected == 1) {
-         // Listen for response from server 
-         packet pkt = {0};
-         int bytes_recvd = recvfrom(sockfd, &pkt, sizeof(pkt), 0, (struct sockaddr*) &serveraddr, &serversize);
-         if (bytes_recvd == 0) fprintf(stderr, "Recevied zero bytes\n");
-         int send_ack = 0; // If new packet is received this guarantees ack is sent even if no data is sent
-         if (bytes_recvd >= HEADER_LEN) {
-            fprintf(stderr, "Received packet- SEQ=%d, ACK=%d.\n", ntohl(pkt.seq), ntohl(pkt.ack));
-            recv_packet(recv_packets, &recv_count, sent_packets, &sent_count, pkt, &next_exp_seq);
-            if (bytes_recvd > HEADER_LEN) send_ack = 1;
-            // Check 1 second timeout
-            if ((pkt.flags >> 1) & 1) {
-               ack_time = time(NULL);
-               // Check for duplicate acks
-               if (ntohl(pkt.ack) == most_recent_ack) {
-                  num_duplicate_acks++;
-                  if (num_duplicate_acks >= 3) {
-                     int lowest_idx = get_lowest_pkt(sent_packets, sent_count);
-                     if (lowest_idx >= 0) {
-                        packet lowest_packet = sent_packets[lowest_idx];
-                        int did_send = sendto(sockfd, &lowest_packet, ntohs(lowest_packet.length) + HEADER_LEN, 0, (struct sockaddr*) &serveraddr, sizeof(serveraddr));
-                        fprintf(stderr, "Retransmitting packet %d b/c received duplicate acks.\n", ntohl(lowest_packet.seq));
-                     }
-                  }
-               } else {
-                  most_recent_ack = ntohl(pkt.ack);
-               }
-            }
-         }
-         // Retransmit if 1 second timer expires
-         if (time(NULL) - ack_time >= 1) {
-            int lowest_idx = get_lowest_pkt(sent_packets, sent_count);
-            if (lowest_idx >= 0) {
-               packet lowest_packet = sent_packets[lowest_idx];
-               int did_send = sendto(sockfd, &lowest_packet, ntohs(lowest_packet.length) + HEADER_LEN, 0, (struct sockaddr*) &serveraddr, sizeof(serveraddr));
-               fprintf(stderr, "Retransmitting packet %d b/c timer expired, sent %d characters.\n", ntohl(lowest_packet.seq), did_send);
-            }
-            ack_time = time(NULL);
-         }
 
-         // Only read data from stdin if there is space in sent buffer
-         if (sent_count < MAX_WINDOW_SIZE) {
-            bytes_read = read(STDIN_FILENO, stdin_buf, sizeof(stdin_buf));
-            if (bytes_read > 0) {
-               // fprintf(stderr, "Got input from stdin.\n");
-               packet pkt = {
-                  .ack = htonl(0),
-                  .seq = htonl(current_seq),
-                  .length = htons(bytes_read),
-                  .flags = 0,
-               };
-               memcpy(pkt.payload, stdin_buf, sizeof(pkt.payload));
-               // Add version of packet without ack
-               fprintf(stderr, "\tAdding packet to send buffer...\n");
-               add_pkt_to_buff(sent_packets, &sent_count, pkt);
-               if (send_ack == 1) {
-                  pkt.ack = htonl(next_exp_seq);
-                  pkt.flags = 0b00000010;
-                  send_ack = 0;
-               }
-               int did_send = sendto(sockfd, &pkt, bytes_read + HEADER_LEN, 0, (struct sockaddr*) &serveraddr, sizeof(serveraddr));
-               fprintf(stderr, "Sent %d characters- SEQ=%d, ACK=%d.\n", did_send, current_seq, ntohl(pkt.ack));
-               current_seq += bytes_read;
-            }
-         }
-         if (send_ack == 1) {
-            packet pkt = {
-               .ack = htonl(next_exp_seq),
-               .seq = htonl(0),
+      if (fds[1].revents & POLLIN) conn.input_ready = true;
+      if (metrics_events(&metrics, &fds[5])) {
+         metric_row row;
+         conn_metrics(&conn, &row);
+         metrics_answer(&metrics, &row, 1);
+      }
+
+      // Handle every datagram that arrived, then flush everything queued in as few syscalls as possible
+      io_recv(&io);
+      while (io_more(&io)) {
+         packet *pkt = NULL;
+         int bytes_recvd = io_next(&io, &pkt, &serveraddr);
+         if (bytes_recvd < HEADER_LEN || !conn_verify(&conn, pkt, &bytes_recvd, opts.checksum)) continue;
+         bool syn = pkt->flags & 1;
+         bool ack = (pkt->flags >> 1) & 1;
+         uint32_t ack_num = ntohl(pkt->ack);
+         uint32_t seq = ntohl(pkt->seq);
+         if (!conn.established) {
+            // Only the SYN-ACK matters until then. It acks our SYN, or our SYN's data too if the server took it.
+            bool accepted = resuming && ack_num == conn.iss + 2 + early_len;
+            if (!syn || !ack || (ack_num != conn.iss + 1 && !accepted)) continue;
+            LOG(LOG_INFO, "Received second handshake packet- SEQ=%u, ACK=%u.\n", seq, ack_num);
+            conn.csum_ok = opts.checksum && (pkt->unused & EXT_CSUM);
+            hs_pkt2 = (packet){
+               .ack = htonl(seq+1),
+               .seq = htonl(conn.iss+1),
                .length = htons(0),
                .flags = 0b00000010,
+               .unused = conn.csum_ok ? EXT_CSUM : 0,
                .payload = {0}
             };
-            int did_send = sendto(sockfd, &pkt, HEADER_LEN, 0, (struct sockaddr*) &serveraddr, sizeof(serveraddr));
-            fprintf(stderr, "ACK=%d\n", next_exp_seq);
+            conn.peer_iss = seq;
+            conn.sack_ok = opts.sack && (pkt->unused & EXT_SACK);
+            conn.comp_ok = opts.compress && (pkt->unused & EXT_COMP);
+            conn.rwnd_ok = opts.recv_buffer > 0 && (pkt->unused & EXT_RWND);
+            conn.fec_ok = opts.fec_n > 0 && (pkt->unused & EXT_FEC);
+            conn.peer_file_size = peer_file_size(pkt, bytes_recvd);
+            conn.peer_max_payload = peer_max_payload(pkt, bytes_recvd);
+            conn.stream_ok = pkt->unused & EXT_STREAM;
+            conn.peer_streams = conn.stream_ok ? peer_streams(pkt, bytes_recvd) : 0;
+            int token_len;
+            const uint8_t *new_token = find_option(pkt, bytes_recvd, OPT_TOKEN, &token_len);
+            if (opts.session != NULL && new_token != NULL && token_len == TOKEN_LEN) session_save(opts.session, &serveraddr, new_token);
+            io_queue(&io, &hs_pkt2, HEADER_LEN, NULL, &conn.addr);
+            LOG(LOG_INFO, "Sent third handshake packet- SEQ=%u, ACK=%u.\n", conn.iss+1, seq+1);
+            // Karn's algorithm: after a resend we can't tell which SYN this answers
+            if (syn_sends == 1) rto_sample(&conn.rto, now_us() - conn.syn_sent_time);
+            // The third handshake packet uses up iss + 1, and the SYN's data (if taken) what follows it
+            conn_establish(&conn, &io, conn.iss + 2 + (accepted ? early_len : 0), seq + 1);
+            if (accepted) {
+               LOG(LOG_INFO, "Server took %d bytes of early data.\n", early_len);
+               conn.stats.packets_sent++;
+               conn.stats.bytes_sent += early_len;
+               conn.stats.bytes_acked += early_len;
+            } else if (early_len > 0) {
+               // Send it again as ordinary data
+               LOG(LOG_INFO, "Server didn't take our early data, resending it.\n");
+               if (src.file) {
+                  conn.src.off -= early_len;
+               } else {
+                  conn.early = syn_pkt.payload;
+                  conn.early_len = early_len;
+               }
+            }
+            continue;
          }
+         if (syn) {
+            // The server resent its SYN-ACK, so our third handshake packet was lost
+            io_queue(&io, &hs_pkt2, HEADER_LEN, NULL, &conn.addr);
+            continue;
+         }
+         conn_recv(&conn, &io, pkt, bytes_recvd);
+         conn_send(&conn, &io);
+      }
+      if (conn.established) {
+         conn_write_output(&conn);
+         // Retransmit if the retransmission timer expires
+         if (conn.rto_deadline != 0 && now_us() >= conn.rto_deadline) conn_timeout(&conn, &io);
+         conn_send(&conn, &io);
+      }
+      io_flush(&io);
+      set_timer_at(timerfd, conn.established ? conn_deadline(&conn) : conn.syn_sent_time + conn.rto.rto);
+      if (conn_output_failed(&conn)) {
+         fprintf(stderr, "Lost output, closing the connection.\n");
+         break;
       }
    }
 
+   print_stats(&conn);
+   bool failed = conn_output_failed(&conn);
+   conn_free(&conn);
+   io_close(&io);
+   metrics_close(&metrics, opts.metrics);
+   close(timerfd);
    close(sockfd);
-   return 0;
+   return failed ? 1 : 0;
 }
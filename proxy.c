@@ -0,0 +1,350 @@
+// Network emulator for testing: a UDP proxy between one client and the server that can drop, delay,
+// jitter, reorder, duplicate, corrupt, rate limit and size limit datagrams in each direction.
+// Usage: ./proxy LISTEN_PORT SERVER_PORT [options]; point the client at LISTEN_PORT.
+//
+// Every random decision comes from a per-direction generator seeded with --seed, and each datagram
+// draws the same number of values, so the n-th datagram in a direction always gets the same fate.
+// Corruption draws from a generator of its own, so turning it on leaves every other fate of a seed as it was.
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+
+#define MAX_DATAGRAM 65536
+#define MAX_QUEUED 65536 // Datagrams in flight through the proxy
+
+// Impairments applied to one direction
+typedef struct {
+   double loss; // Probability a datagram is dropped
+   double dup; // Probability a datagram is delivered twice
+   double reorder; // Probability a datagram is held back an extra reorder_us
+   double corrupt; // Probability one bit of a datagram is flipped
+   uint64_t delay_us; // Fixed one way delay
+   uint64_t jitter_us; // Extra uniformly random delay in [0, jitter_us)
+   uint64_t reorder_us;
+   uint64_t rate_bps; // Bottleneck bandwidth in bits per second, 0 for unlimited
+   uint64_t queue_bytes; // Bottleneck queue size; datagrams that don't fit are dropped
+   uint64_t mtu; // Datagrams bigger than this (with IP and UDP headers) are dropped, 0 for no limit
+} impairments;
+
+// State for one direction
+typedef struct {
+   impairments imp;
+   uint64_t rng;
+   uint64_t corrupt_rng;
+   uint64_t link_free; // When the bottleneck finishes sending what is already queued
+   uint64_t forwarded;
+   uint64_t dropped;
+   uint64_t duplicated;
+   uint64_t reordered;
+   uint64_t corrupted;
+   uint64_t queue_drops;
+   uint64_t too_big;
+} direction;
+
+// A datagram waiting to be delivered
+typedef struct {
+   uint64_t when;
+   uint64_t order; // Tie breaker so equal times keep arrival order
+   bool to_server;
+   int len;
+   uint8_t *data;
+} scheduled;
+
+// Min-heap of scheduled datagrams keyed by delivery time
+typedef struct {
+   scheduled *items;
+   int count;
+} schedule;
+
+volatile sig_atomic_t stop_requested = 0;
+
+void handle_stop(int sig) {
+   stop_requested = 1;
+}
+
+uint64_t now_us() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// xorshift64*: small, fast and identical on every platform, unlike rand()
+uint64_t rng_next(uint64_t *state) {
+   uint64_t x = *state;
+   x ^= x >> 12;
+   x ^= x << 25;
+   x ^= x >> 27;
+   *state = x;
+   return x * 2685821657736338717ULL;
+}
+
+// Uniform double in [0, 1)
+double rng_uniform(uint64_t *state) {
+   return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+bool schedule_before(scheduled *a, scheduled *b) {
+   return a->when < b->when || (a->when == b->when && a->order < b->order);
+}
+
+void schedule_push(schedule *s, scheduled item) {
+   int i = s->count++;
+   s->items[i] = item;
+   while (i > 0 && schedule_before(&s->items[i], &s->items[(i - 1) / 2])) {
+      scheduled tmp = s->items[i];
+      s->items[i] = s->items[(i - 1) / 2];
+      s->items[(i - 1) / 2] = tmp;
+      i = (i - 1) / 2;
+   }
+}
+
+scheduled schedule_pop(schedule *s) {
+   scheduled top = s->items[0];
+   s->items[0] = s->items[--s->count];
+   int i = 0;
+   while (true) {
+      int smallest = i;
+      int l = 2 * i + 1;
+      int r = 2 * i + 2;
+      if (l < s->count && schedule_before(&s->items[l], &s->items[smallest])) smallest = l;
+      if (r < s->count && schedule_before(&s->items[r], &s->items[smallest])) smallest = r;
+      if (smallest == i) break;
+      scheduled tmp = s->items[i];
+      s->items[i] = s->items[smallest];
+      s->items[smallest] = tmp;
+      i = smallest;
+   }
+   return top;
+}
+
+// Decides the fate of one datagram and schedules its delivery (twice if duplicated)
+void impair(direction *d, schedule *s, uint64_t *order, bool to_server, const uint8_t *data, int len) {
+   // Always draw the same number of values so later datagrams' fates don't depend on this one's
+   double loss_draw = rng_uniform(&d->rng);
+   double dup_draw = rng_uniform(&d->rng);
+   double reorder_draw = rng_uniform(&d->rng);
+   double jitter_draw = rng_uniform(&d->rng);
+   double dup_jitter_draw = rng_uniform(&d->rng);
+   double corrupt_draw = rng_uniform(&d->corrupt_rng);
+   uint64_t corrupt_bit = rng_next(&d->corrupt_rng);
+   if (d->imp.mtu > 0 && len + 28 > d->imp.mtu) {
+      d->too_big++;
+      return;
+   }
+   if (loss_draw < d->imp.loss) {
+      d->dropped++;
+      return;
+   }
+   uint64_t now = now_us();
+   uint64_t leave = now; // When the datagram is through the bottleneck
+   if (d->imp.rate_bps > 0) {
+      uint64_t start = d->link_free > now ? d->link_free : now;
+      uint64_t backlog = (start - now) * d->imp.rate_bps / 8000000;
+      if (backlog + len > d->imp.queue_bytes) {
+         d->queue_drops++;
+         return;
+      }
+      leave = start + (uint64_t)len * 8000000 / d->imp.rate_bps;
+      d->link_free = leave;
+   }
+   int copies = dup_draw < d->imp.dup ? 2 : 1;
+   if (copies == 2) d->duplicated++;
+   bool corrupt = corrupt_draw < d->imp.corrupt && len > 0;
+   if (corrupt) d->corrupted++;
+   for (int i = 0; i < copies && s->count < MAX_QUEUED; i++) {
+      uint64_t when = leave + d->imp.delay_us + (uint64_t)((i == 0 ? jitter_draw : dup_jitter_draw) * d->imp.jitter_us);
+      if (i == 0 && reorder_draw < d->imp.reorder) {
+         when += d->imp.reorder_us;
+         d->reordered++;
+      }
+      uint8_t *copy = malloc(len);
+      if (copy == NULL) return;
+      memcpy(copy, data, len);
+      if (corrupt) copy[corrupt_bit % (8 * len) / 8] ^= 1 << corrupt_bit % 8;
+      schedule_push(s, (scheduled){when, (*order)++, to_server, len, copy});
+   }
+   d->forwarded++;
+}
+
+void print_usage(const char *prog) {
+   fprintf(stderr, "Usage: %s LISTEN_PORT SERVER_PORT [options]\n", prog);
+   fprintf(stderr, "Each option applies to both directions; prefix it with up- (client to server) or down- for one.\n");
+   fprintf(stderr, "  --loss P        drop probability (0-1)\n");
+   fprintf(stderr, "  --delay MS      one way delay\n");
+   fprintf(stderr, "  --jitter MS     extra random delay, uniform in [0, MS)\n");
+   fprintf(stderr, "  --reorder P     probability a datagram is held back --reorder-delay MS (default 10)\n");
+   fprintf(stderr, "  --dup P         duplication probability\n");
+   fprintf(stderr, "  --corrupt P     probability one random bit of a datagram is flipped\n");
+   fprintf(stderr, "  --rate MBPS     bottleneck bandwidth in megabits per second\n");
+   fprintf(stderr, "  --queue KB      bottleneck queue (default 256)\n");
+   fprintf(stderr, "  --mtu BYTES     drop datagrams bigger than this, counting IP and UDP headers\n");
+   fprintf(stderr, "  --seed N        random seed (default 1)\n");
+}
+
+// Sets field in the directions selected by mask (bit 0 up, bit 1 down)
+#define SET_BOTH(mask, field, value) do { \
+   if ((mask) & 1) dirs[0].imp.field = (value); \
+   if ((mask) & 2) dirs[1].imp.field = (value); \
+} while (0)
+
+int main(int argc, char *argv[]) {
+   direction dirs[2]; // 0: client to server, 1: server to client
+   memset(dirs, 0, sizeof(dirs));
+   for (int i = 0; i < 2; i++) {
+      dirs[i].imp.reorder_us = 10000;
+      dirs[i].imp.queue_bytes = 256 * 1024;
+   }
+   uint64_t seed = 1;
+
+   // Options come in three flavours: --x (both directions), --up-x and --down-x
+   const char *names[] = {"loss", "delay", "jitter", "reorder", "reorder-delay", "dup", "corrupt", "rate", "queue", "mtu"};
+   int num_names = sizeof(names) / sizeof(names[0]);
+   struct option long_opts[3 * 10 + 3];
+   char name_buf[3 * 10][32];
+   int n = 0;
+   for (int prefix = 0; prefix < 3; prefix++) {
+      for (int i = 0; i < num_names; i++) {
+         snprintf(name_buf[n], sizeof(name_buf[n]), "%s%s", prefix == 0 ? "" : prefix == 1 ? "up-" : "down-", names[i]);
+         long_opts[n] = (struct option){name_buf[n], required_argument, NULL, 256 + n};
+         n++;
+      }
+   }
+   long_opts[n++] = (struct option){"seed", required_argument, NULL, 's'};
+   long_opts[n++] = (struct option){"help", no_argument, NULL, 'h'};
+   long_opts[n] = (struct option){0, 0, 0, 0};
+
+   int opt;
+   while ((opt = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+      if (opt == 's') {
+         seed = strtoull(optarg, NULL, 10);
+         continue;
+      }
+      if (opt < 256) {
+         print_usage(argv[0]);
+         return -1;
+      }
+      int mask = (opt - 256) / num_names == 0 ? 3 : (opt - 256) / num_names == 1 ? 1 : 2;
+      const char *name = names[(opt - 256) % num_names];
+      double value = atof(optarg);
+      if (strcmp(name, "loss") == 0) SET_BOTH(mask, loss, value);
+      else if (strcmp(name, "delay") == 0) SET_BOTH(mask, delay_us, value * 1000);
+      else if (strcmp(name, "jitter") == 0) SET_BOTH(mask, jitter_us, value * 1000);
+      else if (strcmp(name, "reorder") == 0) SET_BOTH(mask, reorder, value);
+      else if (strcmp(name, "reorder-delay") == 0) SET_BOTH(mask, reorder_us, value * 1000);
+      else if (strcmp(name, "dup") == 0) SET_BOTH(mask, dup, value);
+      else if (strcmp(name, "corrupt") == 0) SET_BOTH(mask, corrupt, value);
+      else if (strcmp(name, "rate") == 0) SET_BOTH(mask, rate_bps, value * 1000000);
+      else if (strcmp(name, "queue") == 0) SET_BOTH(mask, queue_bytes, value * 1024);
+      else if (strcmp(name, "mtu") == 0) SET_BOTH(mask, mtu, value);
+   }
+   if (argc - optind < 2) {
+      print_usage(argv[0]);
+      return -1;
+   }
+   int listen_port = atoi(argv[optind]);
+   int server_port = atoi(argv[optind + 1]);
+   dirs[0].rng = seed * 2 + 1; // xorshift state must be nonzero
+   dirs[1].rng = seed * 2 + 2;
+   dirs[0].corrupt_rng = ~dirs[0].rng;
+   dirs[1].corrupt_rng = ~dirs[1].rng;
+
+   // Client side: whoever sends to LISTEN_PORT becomes the client. Server side: a socket connected to the server.
+   int client_sock = socket(AF_INET, SOCK_DGRAM, 0);
+   struct sockaddr_in listen_addr = {.sin_family = AF_INET, .sin_port = htons(listen_port)};
+   listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (bind(client_sock, (struct sockaddr*) &listen_addr, sizeof(listen_addr)) < 0) {
+      fprintf(stderr, "Failed to bind port %d.\n", listen_port);
+      return errno;
+   }
+   int server_sock = socket(AF_INET, SOCK_DGRAM, 0);
+   struct sockaddr_in server_addr = {.sin_family = AF_INET, .sin_port = htons(server_port)};
+   server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (connect(server_sock, (struct sockaddr*) &server_addr, sizeof(server_addr)) < 0) {
+      fprintf(stderr, "Failed to connect to port %d.\n", server_port);
+      return errno;
+   }
+   int buf_size = 4 * 1024 * 1024;
+   setsockopt(client_sock, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+   setsockopt(server_sock, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+
+   struct sigaction sa = {0};
+   sa.sa_handler = handle_stop;
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+
+   schedule sched = {malloc(MAX_QUEUED * sizeof(scheduled)), 0};
+   if (sched.items == NULL) {
+      fprintf(stderr, "Failed to allocate schedule.\n");
+      return -1;
+   }
+   uint64_t order = 0;
+   struct sockaddr_in client_addr;
+   bool have_client = false;
+   static uint8_t buf[MAX_DATAGRAM];
+
+   while (!stop_requested) {
+      int timeout = -1;
+      if (sched.count > 0) {
+         uint64_t now = now_us();
+         uint64_t when = sched.items[0].when;
+         timeout = when > now ? (when - now + 999) / 1000 : 0;
+      }
+      struct pollfd fds[2] = {
+         {.fd = client_sock, .events = POLLIN},
+         {.fd = server_sock, .events = POLLIN}
+      };
+      if (poll(fds, 2, timeout) < 0) {
+         if (errno == EINTR) continue;
+         fprintf(stderr, "Error polling for events.\n");
+         break;
+      }
+      if (fds[0].revents & POLLIN) {
+         struct sockaddr_in from;
+         socklen_t from_len = sizeof(from);
+         int len;
+         while ((len = recvfrom(client_sock, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*) &from, &from_len)) >= 0) {
+            client_addr = from;
+            have_client = true;
+            impair(&dirs[0], &sched, &order, true, buf, len);
+         }
+      }
+      if (fds[1].revents & POLLIN) {
+         int len;
+         while ((len = recv(server_sock, buf, sizeof(buf), MSG_DONTWAIT)) >= 0) {
+            impair(&dirs[1], &sched, &order, false, buf, len);
+         }
+      }
+      // Deliver everything that is due
+      uint64_t now = now_us();
+      while (sched.count > 0 && sched.items[0].when <= now) {
+         scheduled item = schedule_pop(&sched);
+         if (item.to_server) {
+            send(server_sock, item.data, item.len, 0);
+         } else if (have_client) {
+            sendto(client_sock, item.data, item.len, 0, (struct sockaddr*) &client_addr, sizeof(client_addr));
+         }
+         free(item.data);
+      }
+   }
+
+   for (int i = 0; i < 2; i++) {
+      direction *d = &dirs[i];
+      fprintf(stderr, "Proxy %s: %" PRIu64 " forwarded, %" PRIu64 " dropped, %" PRIu64 " queue drops, %" PRIu64 " too big, %" PRIu64 " duplicated, %" PRIu64 " reordered, %" PRIu64 " corrupted\n",
+              i == 0 ? "up" : "down", d->forwarded, d->dropped, d->queue_drops, d->too_big, d->duplicated, d->reordered, d->corrupted);
+   }
+   close(client_sock);
+   close(server_sock);
+   return 0;
+}